@@ -14,6 +14,18 @@ class GstPlayDaemon
     @pubsub.connect pubsub_addr
   end
 
+  ## Topics look like "pipeline/error" or "player/<id>/preloaded"; an
+  ## empty prefix gets you everything
+  def subscribe(topic_prefix = "")
+    @pubsub.setsockopt(ZMQ::SUBSCRIBE, topic_prefix)
+  end
+
+  def next_event
+    topic = @pubsub.recv
+    body = @pubsub.getsockopt(ZMQ::RCVMORE) ? @pubsub.recv : nil
+    [topic, body]
+  end
+
   def ping
     msg = "GstPlayDaemon"
     @rep.send "PING #{msg}"
@@ -26,21 +38,108 @@ class GstPlayDaemon
     @rep.close; @rep = nil
   end
 
-  def tags(uri)
-    @rep.send "TAGS #{uri}"
-    response_to_tag_dict(@rep.recv)
+  ## Pass :binary => true to get cover art as raw bytes rather than
+  ## base64, or :images => false to leave it out altogether.
+  ## :msgpack => true has the values come back typed (needs the msgpack
+  ## gem), and is immune to values with newlines in them
+  def tags(uri, opts = {})
+    flags = []
+    flags << "-binary" if opts[:binary]
+    flags << "-noimages" if opts[:images] == false
+    flags << "-msgpack" if opts[:msgpack]
+
+    @rep.send "TAGS #{(flags + [uri]).join(' ')}"
+    msg = @rep.recv
+
+    frames = []
+    frames << @rep.recv while @rep.getsockopt(ZMQ::RCVMORE)
+
+    if opts[:msgpack]
+      require 'msgpack'
+      parse_response msg
+      return MessagePack.unpack(frames.first)
+    end
+
+    response_to_tag_dict(msg, frames)
+  end
+
+  ## Tags for every file under each root turn up on "scan/<id>/file",
+  ## then a "scan/<id>/done"; returns the id
+  def scan(*roots)
+    arg = roots.length == 1 ? roots.first : roots.map { |r| "'#{r.gsub("'") { "'\\''" }}'" }.join(' ')
+    @rep.send "SCAN #{arg}"
+    parse_response(@rep.recv)[/scan id: ([0-9]+)/, 1].to_i
+  end
+
+  ## at is a pipeline running time in nanoseconds, see clock
+  def play(uri, at = nil)
+    @rep.send(at ? "PLAY #{uri} @#{at}" : "PLAY #{uri}")
+    return parse_response(@rep.recv).gsub(/.*: /, '')
   end
 
-  def play(uri)
-    @rep.send "PLAY #{uri}"
+  def preload(uri)
+    @rep.send "PRELOAD #{uri}"
     return parse_response(@rep.recv).gsub(/.*: /, '')
   end
 
-  def stop(id)
-    @rep.send "STOP #{id}"
+  def stop(id, at = nil)
+    @rep.send(at ? "STOP #{id} @#{at}" : "STOP #{id}")
+    parse_response(@rep.recv); nil
+  end
+
+  ## volume is linear, 1.0 being unchanged
+  def fade(id, volume, ms)
+    @rep.send "FADE #{id} #{volume} #{ms}"
+    parse_response(@rep.recv); nil
+  end
+
+  ## Fades from out and stops it while fading to in; to may be preloaded
+  def crossfade(from, to, ms)
+    @rep.send "CROSSFADE #{from} #{to} #{ms}"
     parse_response(@rep.recv); nil
   end
 
+  ## format is "mp3" or "ogg"; policy is "block", "drop-oldest" or
+  ## "bounded-latency:<ms>", or nil for the daemon's --queue-policy
+  def mount(format, mount, policy = nil)
+    @rep.send ["MOUNT #{format} #{mount}", policy].compact.join(' ')
+    parse_response(@rep.recv)
+  end
+
+  def unmount(mount)
+    @rep.send "UNMOUNT #{mount}"
+    parse_response(@rep.recv)
+  end
+
+  ## The daemon's most recent trace records, one per line; count defaults
+  ## to whatever the daemon thinks is sensible
+  def trace(count = nil)
+    @rep.send "TRACE #{count}"
+    msg = @rep.recv
+    parse_response msg
+    msg.lines.drop(1).map(&:chomp)
+  end
+
+  ## The pipeline's current running time in nanoseconds
+  def clock
+    @rep.send "CLOCK "
+    parse_response(@rep.recv)[/running-time: ([0-9]+)/, 1].to_i
+  end
+
+  ## Runs every command in one round trip, e.g.
+  ## multi("STOP 1", "PLAY file:///foo.mp3"); returns each one's reply.
+  ## Commands that ran before one that failed stay applied
+  def multi(*commands)
+    @rep.send "MULTI\n#{commands.join("\n")}"
+    msg = @rep.recv
+    parse_response msg
+
+    msg.split("\n").drop(1).inject([]) do |acc,line|
+      line.start_with?(" ") ? acc[-1] << "\n#{line[1..-1]}" : acc << line
+      acc
+    end
+  end
+
 private
 
   def parse_response(msg)
@@ -51,7 +150,7 @@ private
     m[2]
   end
 
-  def response_to_tag_dict(msg)
+  def response_to_tag_dict(msg, frames = [])
     parse_response msg
 
     re = /^(.*)_([0-9]+)$/  ## someparam_0
@@ -59,8 +158,12 @@ private
       key,value = x
       m = re.match key
 
+      value = value.chomp
+      f = /^frame:([0-9]+)$/.match value
+      value = frames[f[1].to_i - 1] if f && frames[f[1].to_i - 1]
+
       acc[m[1]] ||= []
-      acc[m[1]] << value.chomp
+      acc[m[1]] << value
       acc
     end
   end
@@ -0,0 +1,187 @@
+#!/usr/bin/env ruby
+
+## Exercises MOUNT and UNMOUNT against a stand-in for Icecast: a local
+## listener that accepts source connections the way the real server does
+## and records what comes down them. No sound card is needed, since the
+## daemon is run with --render null.
+##
+##   ruby extras/icecast-standin-test.rb [path/to/gst_playd]
+##
+## Exits non-zero if anything didn't turn up as expected.
+
+require 'base64'
+require 'socket'
+require 'tmpdir'
+require 'timeout'
+
+require File.join(File.dirname(__FILE__), 'gst-playd-client')
+
+PASSWORD = "standin"
+WAIT_SECS = 15
+
+## One source connection, as seen from the server end
+class SourceConnection
+  attr_reader :request, :headers, :data
+
+  def initialize(sock)
+    @sock = sock
+    @data = "".force_encoding("BINARY")
+    @closed = false
+    @lock = Mutex.new
+  end
+
+  def run
+    @request = @sock.gets.to_s.chomp
+    @headers = {}
+    while (line = @sock.gets) && line.chomp != ""
+      key, value = line.chomp.split(": ", 2)
+      @headers[key.downcase] = value
+    end
+
+    ## libshout takes any 200 as the go-ahead, whether it sent SOURCE
+    ## or PUT
+    @sock.write "HTTP/1.0 200 OK\r\n\r\n"
+
+    while (chunk = @sock.readpartial(4096) rescue nil)
+      @lock.synchronize { @data << chunk }
+    end
+  ensure
+    @closed = true
+    @sock.close
+  end
+
+  def mount
+    @request.to_s.split(' ')[1]
+  end
+
+  def password
+    auth = @headers["authorization"].to_s[/^Basic (.*)$/, 1]
+    auth && Base64.decode64(auth).split(':', 2)[1]
+  end
+
+  def received
+    @lock.synchronize { @data.dup }
+  end
+
+  def closed?
+    @closed
+  end
+end
+
+class IcecastStandin
+  attr_reader :port
+
+  def initialize
+    @server = TCPServer.new('127.0.0.1', 0)
+    @port = @server.addr[1]
+    @connections = []
+    @lock = Mutex.new
+
+    Thread.new do
+      loop do
+        conn = SourceConnection.new(@server.accept)
+        @lock.synchronize { @connections << conn }
+        Thread.new { conn.run }
+      end
+    end
+  end
+
+  def connection(mount)
+    @lock.synchronize { @connections.find { |c| c.mount == mount } }
+  end
+end
+
+## A few seconds of a sine wave, so the test doesn't depend on any media
+## being around
+def write_wav(path, secs)
+  rate, channels = 44100, 2
+  samples = (0...(rate * secs)).map { |i| (Math.sin(2 * Math::PI * 440 * i / rate) * 8000).round }
+  pcm = samples.flat_map { |s| [s] * channels }.pack('s<*')
+
+  File.open(path, 'wb') do |f|
+    f.write ['RIFF', 36 + pcm.bytesize, 'WAVE'].pack('a4Va4')
+    f.write ['fmt ', 16, 1, channels, rate, rate * channels * 2, channels * 2, 16].pack('a4VvvVVvv')
+    f.write ['data', pcm.bytesize].pack('a4V')
+    f.write pcm
+  end
+end
+
+def free_port
+  s = TCPServer.new('127.0.0.1', 0)
+  s.addr[1]
+ensure
+  s.close
+end
+
+def wait_for(what)
+  Timeout.timeout(WAIT_SECS) do
+    sleep 0.1 until yield
+  end
+  true
+rescue Timeout::Error
+  puts "FAIL #{what}"
+  $failures += 1
+  false
+end
+
+def check(what, ok)
+  puts "#{ok ? 'ok  ' : 'FAIL'} #{what}"
+  $failures += 1 unless ok
+end
+
+$failures = 0
+
+daemon = ARGV[0] || File.join(File.dirname(__FILE__), '..', 'src', 'gst_playd')
+standin = IcecastStandin.new
+control_port = free_port
+
+Dir.mktmpdir do |dir|
+  wav = File.join(dir, 'sine.wav')
+  write_wav(wav, 5)
+
+  pid = spawn(daemon, '-p', control_port.to_s, '--render', 'null',
+    '--icecast-host', '127.0.0.1', '--icecast-port', standin.port.to_s,
+    '--icecast-password', PASSWORD)
+
+  begin
+    client = Timeout.timeout(WAIT_SECS) do
+      GstPlayDaemon.new("tcp://127.0.0.1:#{control_port}")
+    end
+
+    check "MOUNT mp3", client.mount("mp3", "/test.mp3") =~ /mounts: 1 encoders: 1/
+    check "MOUNT ogg", client.mount("ogg", "/a.ogg") =~ /mounts: 2 encoders: 2/
+    client.play("file://#{wav}")
+
+    if wait_for("mp3 source never connected") { (c = standin.connection("/test.mp3")) && c.received.bytesize > 0 }
+      conn = standin.connection("/test.mp3")
+      check "mp3 source sent the password", conn.password == PASSWORD
+    end
+
+    wait_for("first ogg source never got data") { (c = standin.connection("/a.ogg")) && c.received.bytesize > 0 }
+
+    ## A mount that joins once the mix is already going shares the running
+    ## encoder, but still has to start with the Vorbis headers, or nothing
+    ## can play it
+    check "MOUNT ogg while playing", client.mount("ogg", "/b.ogg") =~ /mounts: 3 encoders: 2/
+    client.play("file://#{wav}")
+
+    ["/a.ogg", "/b.ogg"].each do |mount|
+      if wait_for("#{mount} never got the Vorbis headers") { (c = standin.connection(mount)) && c.received.include?("\x01vorbis") }
+        check "#{mount} starts with an Ogg page", standin.connection(mount).received.start_with?("OggS")
+      end
+    end
+
+    check "UNMOUNT", client.unmount("/test.mp3") =~ /mounts: 2 encoders: 1/
+    wait_for("mp3 source wasn't closed after UNMOUNT") { standin.connection("/test.mp3").closed? }
+
+    check "UNMOUNT of an unknown mount fails", ((client.unmount("/nope.mp3") rescue :failed) == :failed)
+  rescue Timeout::Error
+    check "gst_playd answered", false
+  ensure
+    Process.kill('TERM', pid)
+    Process.wait(pid)
+  end
+end
+
+puts($failures == 0 ? "All good" : "#{$failures} failed")
+exit($failures == 0 ? 0 : 1)
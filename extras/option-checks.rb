@@ -0,0 +1,37 @@
+#!/usr/bin/env ruby
+
+## Runs gst_playd with options it should refuse, and checks that it exits
+## with an error rather than starting up or crashing on the way out.
+##
+##   ruby extras/option-checks.rb [path/to/gst_playd]
+##
+## Exits non-zero if any of them didn't.
+
+require 'timeout'
+
+BAD_OPTIONS = [
+  ['--queue-policy=bogus'],
+  ['--mix-format=bogus'],
+  ['--mix-format=F32:44100:6'],
+]
+
+daemon = ARGV[0] || File.join(File.dirname(__FILE__), '..', 'src', 'gst_playd')
+failures = 0
+
+BAD_OPTIONS.each do |args|
+  pid = spawn(daemon, *args, :err => File::NULL)
+  status = begin
+    Timeout.timeout(10) { Process.wait2(pid)[1] }
+  rescue Timeout::Error
+    Process.kill('KILL', pid)
+    Process.wait(pid)
+    nil
+  end
+
+  ok = status && status.exited? && status.exitstatus == 1
+  puts "#{ok ? 'ok  ' : 'FAIL'} #{args.join(' ')}: #{status ? status.inspect : 'still running'}"
+  failures += 1 unless ok
+end
+
+puts(failures == 0 ? "All good" : "#{failures} failed")
+exit(failures == 0 ? 0 : 1)
@@ -0,0 +1,88 @@
+#!/usr/bin/env ruby
+
+## Starts a gst_playd of its own (with --render null, so no sound card is
+## needed) and checks how it answers a handful of requests.
+##
+##   ruby extras/protocol-checks.rb [path/to/gst_playd]
+##
+## Exits non-zero if anything didn't come back as expected.
+
+require 'socket'
+require 'tmpdir'
+require 'timeout'
+
+require File.join(File.dirname(__FILE__), 'gst-playd-client')
+
+WAIT_SECS = 15
+
+def free_port
+  s = TCPServer.new('127.0.0.1', 0)
+  s.addr[1]
+ensure
+  s.close
+end
+
+def check(what)
+  ok = begin
+    yield
+  rescue StandardError, UncaughtThrowError => e
+    puts "     #{e.message}"
+    false
+  end
+
+  puts "#{ok ? 'ok  ' : 'FAIL'} #{what}"
+  $failures += 1 unless ok
+end
+
+def fails?
+  yield
+  false
+rescue StandardError, UncaughtThrowError
+  true
+end
+
+$failures = 0
+
+daemon = ARGV[0] || File.join(File.dirname(__FILE__), '..', 'src', 'gst_playd')
+control_port = free_port
+
+pid = spawn(daemon, '-p', control_port.to_s, '--render', 'null')
+
+begin
+  client = Timeout.timeout(WAIT_SECS) do
+    GstPlayDaemon.new("tcp://127.0.0.1:#{control_port}")
+  end
+
+  check("TRACE with no count") { client.trace.is_a?(Array) }
+  check("TRACE with a count") { client.trace(5).length <= 5 }
+  check("TRACE with spaces around the count") { client.trace(" 5 ").length <= 5 }
+  check("TRACE with a bad count fails") { fails? { client.trace("x") } }
+  check("TRACE 0 fails") { fails? { client.trace(0) } }
+
+  Dir.mktmpdir do |dir|
+    other = File.join(dir, "with space's")
+    Dir.mkdir(other)
+
+    check("SCAN of one root with spaces") { client.scan(other) > 0 }
+    check("SCAN of several quoted roots") { client.scan(dir, other) > 0 }
+    check("SCAN of a relative path fails") { fails? { client.scan("Music") } }
+    check("SCANs in a MULTI") do
+      replies = client.multi("SCAN #{dir}", "SCAN #{other}")
+      replies.length == 2 && replies.all? { |r| r.start_with?("OK scan id:") }
+    end
+  end
+
+  check("MULTI keeps going past a command that fails, and says so") do
+    replies = client.multi("PING first", "STOP 999999", "PING last")
+    replies.length == 3 && replies[1].start_with?("FAIL") && replies[2].end_with?("last")
+  end
+  check("MULTI with an unknown verb runs nothing") { fails? { client.multi("PING first", "BOGUS") } }
+rescue Timeout::Error
+  check("gst_playd answered") { false }
+ensure
+  Process.kill('TERM', pid)
+  Process.wait(pid)
+end
+
+puts($failures == 0 ? "All good" : "#{$failures} failed")
+exit($failures == 0 ? 0 : 1)
@@ -24,12 +24,27 @@
 
 #include "gst-util.h"
 #include "uuencode.h"
+#include "msgpack.h"
+#include "parser.h"
+#include "trace.h"
+
+struct tag_table_closure {
+	GHashTable* table;
+	guint flags;
+	GPtrArray* frames;
+};
+
+static void buffer_frame_free(void* data, void* hint)
+{
+	gst_buffer_unref(GST_BUFFER(hint));
+}
 
 static void tag_to_hash_table(const GstTagList * list, const gchar * tag, gpointer user_data) 
 {
 	char* value;
 	int num = gst_tag_list_get_tag_size (list, tag); 
-	GHashTable* ret = (GHashTable*)user_data;
+	struct tag_table_closure* closure = (struct tag_table_closure*)user_data;
+	GHashTable* ret = closure->table;
 
 	for (int i = 0; i < num; ++i) {
 		const GValue *val = gst_tag_list_get_value_index (list, tag, i); 
@@ -47,6 +62,17 @@ static void tag_to_hash_table(const GstTagList * list, const gchar * tag, gpoint
 		} else if (GST_VALUE_HOLDS_BUFFER (val)) {
 			GstBuffer* buf = gst_value_get_buffer(val);
 
+			if (closure->flags & GSU_TAGS_NO_IMAGES) {
+				continue;
+			}
+
+			/* The frame keeps the buffer alive until it's been sent */
+			if (closure->flags & GSU_TAGS_BINARY) {
+				parse_frames_add(closure->frames, GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf), buffer_frame_free, gst_buffer_ref(buf));
+				g_hash_table_insert(ret, g_strdup_printf("%s_%d", tag, i), g_strdup_printf("frame:%u", closure->frames->len));
+				continue;
+			}
+
 			int size = uuencode_get_length(GST_BUFFER_SIZE(buf));
 			value = g_new0 (char, size + 1);
 			uuencode(value, GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf), uuenc_tbl_base64);
@@ -59,12 +85,135 @@ static void tag_to_hash_table(const GstTagList * list, const gchar * tag, gpoint
 			value = g_strdup_printf ("tag of type ’%s’", G_VALUE_TYPE_NAME (val)); 
 		}
 
-		g_warning("Found tag: %s", tag);
+		TRACE(TRACE_LEVEL_DEBUG, TRACE_TAG, tag, NULL, 0);
 		g_hash_table_insert(ret, g_strdup_printf("%s_%d", tag, i), value);
 	}
 }
 
 void gsu_tags_to_hash_table(const GstTagList* tags, GHashTable* table)
 {
-	gst_tag_list_foreach(tags, tag_to_hash_table, table);
+	gsu_tags_to_hash_table_full(tags, table, 0, NULL);
+}
+
+void gsu_tags_to_hash_table_full(const GstTagList* tags, GHashTable* table, guint flags, GPtrArray* frames)
+{
+	struct tag_table_closure closure = { table, flags, frames };
+
+	gst_tag_list_foreach(tags, tag_to_hash_table, &closure);
+}
+
+struct tag_pack_closure {
+	GByteArray* buf;
+	guint flags;
+	guint32 count;
+};
+
+static void tag_value_to_msgpack(GByteArray* buf, const GValue* val)
+{
+	if (G_VALUE_HOLDS_STRING(val)) {
+		const char* str = g_value_get_string(val);
+		msgpack_write_str(buf, str, strlen(str));
+	} else if (G_VALUE_HOLDS_UINT(val)) {
+		msgpack_write_uint(buf, g_value_get_uint(val));
+	} else if (G_VALUE_HOLDS_INT(val)) {
+		msgpack_write_int(buf, g_value_get_int(val));
+	} else if (G_VALUE_HOLDS_UINT64(val)) {
+		msgpack_write_uint(buf, g_value_get_uint64(val));
+	} else if (G_VALUE_HOLDS_INT64(val)) {
+		msgpack_write_int(buf, g_value_get_int64(val));
+	} else if (G_VALUE_HOLDS_DOUBLE(val)) {
+		msgpack_write_double(buf, g_value_get_double(val));
+	} else if (G_VALUE_HOLDS_FLOAT(val)) {
+		msgpack_write_double(buf, g_value_get_float(val));
+	} else if (G_VALUE_HOLDS_BOOLEAN(val)) {
+		msgpack_write_bool(buf, g_value_get_boolean(val));
+	} else if (GST_VALUE_HOLDS_BUFFER(val)) {
+		GstBuffer* gbuf = gst_value_get_buffer(val);
+		msgpack_write_bin(buf, GST_BUFFER_DATA(gbuf), GST_BUFFER_SIZE(gbuf));
+	} else if (GST_VALUE_HOLDS_DATE(val)) {
+		char date[32];
+		gsize len = g_date_strftime(date, sizeof(date), "%F", gst_value_get_date(val));
+		msgpack_write_str(buf, date, len);
+	} else {
+		char* desc = g_strdup_printf("tag of type %s", G_VALUE_TYPE_NAME(val));
+		msgpack_write_str(buf, desc, strlen(desc));
+		g_free(desc);
+	}
+}
+
+static void tag_to_msgpack(const GstTagList* list, const gchar* tag, gpointer user_data)
+{
+	struct tag_pack_closure* closure = (struct tag_pack_closure*)user_data;
+	int num = gst_tag_list_get_tag_size(list, tag);
+
+	/* A tag's values all have the same type */
+	if (num == 0 || ((closure->flags & GSU_TAGS_NO_IMAGES) && GST_VALUE_HOLDS_BUFFER(gst_tag_list_get_value_index(list, tag, 0)))) {
+		return;
+	}
+
+	msgpack_write_str(closure->buf, tag, strlen(tag));
+	msgpack_write_array(closure->buf, num);
+
+	for (int i = 0; i < num; i++) {
+		tag_value_to_msgpack(closure->buf, gst_tag_list_get_value_index(list, tag, i));
+	}
+
+	TRACE(TRACE_LEVEL_DEBUG, TRACE_TAG, tag, NULL, num);
+	closure->count++;
+}
+
+GByteArray* gsu_tags_to_msgpack(const GstTagList* tags, guint flags)
+{
+	struct tag_pack_closure closure = { g_byte_array_new(), flags, 0 };
+	guint header = msgpack_write_map_placeholder(closure.buf);
+
+	gst_tag_list_foreach(tags, tag_to_msgpack, &closure);
+	msgpack_patch_map(closure.buf, header, closure.count);
+
+	return closure.buf;
+}
+
+GstCaps* gsu_mix_format_caps(const char* format)
+{
+	GstCaps* ret = NULL;
+	char* end;
+	guint64 rate, channels;
+
+	char** args = g_strsplit(format, ":", 3);
+	if (!args[0] || !args[1] || !args[2]) {
+		goto out;
+	}
+
+	rate = g_ascii_strtoull(args[1], &end, 10);
+	if (end == args[1] || *end || rate < 8000 || rate > 192000) {
+		goto out;
+	}
+
+	/* 0.10 wants channel positions past stereo */
+	channels = g_ascii_strtoull(args[2], &end, 10);
+	if (end == args[2] || *end || channels < 1 || channels > 2) {
+		goto out;
+	}
+
+	if (!g_ascii_strcasecmp(args[0], "F32")) {
+		ret = gst_caps_new_simple("audio/x-raw-float",
+			"rate", G_TYPE_INT, (gint)rate,
+			"channels", G_TYPE_INT, (gint)channels,
+			"endianness", G_TYPE_INT, G_BYTE_ORDER,
+			"width", G_TYPE_INT, 32,
+			NULL);
+	} else if (!g_ascii_strcasecmp(args[0], "S16")) {
+		ret = gst_caps_new_simple("audio/x-raw-int",
+			"rate", G_TYPE_INT, (gint)rate,
+			"channels", G_TYPE_INT, (gint)channels,
+			"endianness", G_TYPE_INT, G_BYTE_ORDER,
+			"width", G_TYPE_INT, 16,
+			"depth", G_TYPE_INT, 16,
+			"signed", G_TYPE_BOOLEAN, TRUE,
+			NULL);
+	}
+
+out:
+	g_strfreev(args);
+	return ret;
 }
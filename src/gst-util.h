@@ -25,6 +25,30 @@
 #include <glib.h>
 #include <gst/gst.h>
 
+enum gsu_tag_flags {
+	/* Leave buffer-valued tags (cover art, attachments) out */
+	GSU_TAGS_NO_IMAGES = 1 << 0,
+
+	/* Hand buffer-valued tags over as parse_frames instead of base64, and
+	 * put "frame:<n>" in the table, n counting from 1 */
+	GSU_TAGS_BINARY = 1 << 1,
+
+	/* Reply with gsu_tags_to_msgpack rather than the text table */
+	GSU_TAGS_MSGPACK = 1 << 2,
+};
+
 void gsu_tags_to_hash_table(const GstTagList* tags, GHashTable* table);
 
+/* frames must be a parse_frames_new() array if flags has GSU_TAGS_BINARY */
+void gsu_tags_to_hash_table_full(const GstTagList* tags, GHashTable* table, guint flags, GPtrArray* frames);
+
+/* A MessagePack map of tag name to an array of its values, typed as they
+ * are in the tag list; buffers are bin, dates are "YYYY-MM-DD" strings.
+ * Only GSU_TAGS_NO_IMAGES applies. */
+GByteArray* gsu_tags_to_msgpack(const GstTagList* tags, guint flags);
+
+/* Fixed raw audio caps for a "<F32|S16>:<rate>:<channels>" string (e.g.
+ * "F32:44100:2"), or NULL if it isn't one; channels is 1 or 2 */
+GstCaps* gsu_mix_format_caps(const char* format);
+
 #endif
@@ -32,28 +32,75 @@
 
 #include "parser.h"
 #include "utility.h"
+#include "gst-util.h"
+#include "zmq-source.h"
+#include "tag-cache.h"
+#include "stats.h"
+#include "trace.h"
 #include "op_services.h"
 
 #include "operations/ping.h"
 #include "operations/control.h"
 #include "operations/play.h"
+#include "operations/tags.h"
 
 #define EXIT_FAILURE 1
 
 static gboolean verbose = FALSE;
 static gboolean pubsub_listen = FALSE;
+static GPtrArray* pubsub_filters = NULL;
 static char* client_message = NULL;
 static int icecast_port = 8000;
+static char* tag_cache_path = NULL;
+static int tag_cache_size = 1024;
+static int tag_workers = 0;
+static int source_pool_size = 8;
+static char* icecast_host = "127.0.0.1";
+static int icecast_server_port = 8000;
+static char* icecast_password = "hackme";
+static char* queue_policy = "drop-oldest";
+static char* render_path = NULL;
+static int stats_interval = 0;
+static int position_interval = 250;
+static char* mix_format = "F32:44100:2";
+
+static gboolean parse_events_listen(const gchar* option_name, const gchar* value, gpointer data, GError** error)
+{
+	pubsub_listen = TRUE;
+
+	/* NB: GOption frees value once we return */
+	if (value && *value) {
+		if (!pubsub_filters) {
+			pubsub_filters = g_ptr_array_new_with_free_func(g_free);
+		}
+
+		g_ptr_array_add(pubsub_filters, g_strdup(value));
+	}
+
+	return TRUE;
+}
 
 static GOptionEntry entries[] = {
 	 { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL },
 	 { "send-message", 's', 0, G_OPTION_ARG_STRING, &client_message, "Send a message to a running gst_playd and exit", NULL },
-	 { "events-listen", 'e', 0, G_OPTION_ARG_NONE, &pubsub_listen, "Listen to the event stream of a running gst_playd (for debugging purposes)", NULL },
+	 { "events-listen", 'e', G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, parse_events_listen, "Listen to the event stream of a running gst_playd (for debugging purposes), optionally (--events-listen=TOPIC) only to topics starting with TOPIC; can be given more than once", "TOPIC" },
 	 { "port", 'p', 0, G_OPTION_ARG_INT, &icecast_port, "Set the port that Icecast will bind to", NULL },
+	 { "icecast-host", 0, 0, G_OPTION_ARG_STRING, &icecast_host, "Address of the Icecast server that MOUNT connects to", "HOST" },
+	 { "icecast-port", 0, 0, G_OPTION_ARG_INT, &icecast_server_port, "Port of the Icecast server that MOUNT connects to (default 8000)", "PORT" },
+	 { "icecast-password", 0, 0, G_OPTION_ARG_STRING, &icecast_password, "Source password for the Icecast server", "PASSWORD" },
+	 { "queue-policy", 0, 0, G_OPTION_ARG_STRING, &queue_policy, "What a mount's queue does when its listener falls behind: block, drop-oldest or bounded-latency:<ms>", "POLICY" },
+	 { "render", 0, 0, G_OPTION_ARG_FILENAME, &render_path, "Mix as fast as possible into a WAV file instead of playing it (\"null\" to throw the audio away)", "PATH" },
+	 { "stats-interval", 0, 0, G_OPTION_ARG_INT, &stats_interval, "Publish a STATS snapshot on the event stream every N seconds", "SECS" },
+	 { "position-interval", 0, 0, G_OPTION_ARG_INT, &position_interval, "How often to publish the position of every playing source, in milliseconds (0 to never)", "MSEC" },
+	 { "tag-cache", 0, 0, G_OPTION_ARG_FILENAME, &tag_cache_path, "Where to keep the tag cache between runs (empty to keep it in memory)", "PATH" },
+	 { "tag-cache-size", 0, 0, G_OPTION_ARG_INT, &tag_cache_size, "Number of files to keep tags in memory for", "N" },
+	 { "tag-workers", 0, 0, G_OPTION_ARG_INT, &tag_workers, "Number of threads reading tags (defaults to one per CPU)", "N" },
+	 { "mix-format", 0, 0, G_OPTION_ARG_STRING, &mix_format, "Format that every source is converted to before mixing, as <F32|S16>:<rate>:<channels>", "FORMAT" },
+	 { "source-pool", 0, 0, G_OPTION_ARG_INT, &source_pool_size, "Number of idle decoders to keep around for reuse (0 to disable)", "N" },
 	 { NULL },
 };
 
-struct timer_closure {
+struct socket_closure {
 	void* zmq_socket;
 	struct parse_ctx* parse_ctx;
 	GMainLoop* main_loop;
@@ -61,51 +108,138 @@ struct timer_closure {
 	gboolean pubsub_mode;
 };
 
+/* How many requests we'll take per wakeup before giving the rest of the
+ * main loop (i.e. the pipeline bus) a turn */
+#define MAX_REQUESTS_PER_WAKEUP 64
+
 static struct parser_plugin_entry parser_operations[] = {
 	{ "Ping", NULL, op_ping_new, op_ping_register, op_ping_free },
 	{ "Control", NULL, op_control_new, op_control_register, op_control_free },
-	{ "Playback", NULL, op_playback_new, op_playback_register, op_playback_free },
+	{ "Playback", NULL, op_playback_new, op_playback_register, op_playback_free, op_playback_batch_begin, op_playback_batch_commit },
+	{ "Tags", NULL, op_tags_new, op_tags_register, op_tags_free },
 	{ NULL },
 };
 
-static char* zeromq_address_from_port(const char* address, int port)
+/* The ROUTER socket hands us each request as [identity frames..., empty
+ * delimiter, body], and the envelope has to go back in front of the reply
+ * so it finds its way to the right client. */
+static GPtrArray* envelope_new(void)
+{
+	return g_ptr_array_new_with_free_func(util_byte_array_free);
+}
+
+static void envelope_free(GPtrArray* envelope)
+{
+	g_ptr_array_free(envelope, TRUE);
+}
+
+/* Takes ownership of data and of frames, which may be NULL */
+static void send_reply(void* zmq_sock, GPtrArray* envelope, char* data, GPtrArray* frames)
+{
+	TRACE(TRACE_LEVEL_DEBUG, TRACE_REPLY, NULL, data, strlen(data));
+
+	for (guint i = 0; i < envelope->len; i++) {
+		GByteArray* frame = g_ptr_array_index(envelope, i);
+		zmq_msg_t frame_msg;
+
+		zmq_msg_init_size(&frame_msg, frame->len);
+		memcpy(zmq_msg_data(&frame_msg), frame->data, frame->len);
+		zmq_msg_send(&frame_msg, zmq_sock, ZMQ_SNDMORE);
+		zmq_msg_close(&frame_msg);
+	}
+
+	guint n_frames = (frames ? frames->len : 0);
+
+	zmq_msg_t rep_msg;
+	zmq_msg_init_data(&rep_msg, (void*)data, sizeof(char) * strlen(data), util_zmq_glib_free, NULL);
+	zmq_msg_send(&rep_msg, zmq_sock, (n_frames > 0 ? ZMQ_SNDMORE : 0));
+	zmq_msg_close(&rep_msg);
+
+	/* Binary frames go out without a copy; ZeroMQ calls their free
+	 * function once they're on the wire */
+	for (guint i = 0; i < n_frames; i++) {
+		struct parse_frame* frame = g_ptr_array_index(frames, i);
+		zmq_msg_t frame_msg;
+
+		zmq_msg_init_data(&frame_msg, frame->data, frame->len, frame->free_func, frame->hint);
+		frame->free_func = NULL;
+
+		zmq_msg_send(&frame_msg, zmq_sock, (i + 1 < n_frames ? ZMQ_SNDMORE : 0));
+		zmq_msg_close(&frame_msg);
+	}
+
+	if (frames) g_ptr_array_free(frames, TRUE);
+}
+
+static void send_deferred_reply(void* envelope, char* message, GPtrArray* frames, void* user_data)
 {
-	return g_strdup_printf("tcp://%s:%d", address, port + 10000);
+	struct socket_closure* closure = (struct socket_closure*) user_data;
+
+	send_reply(closure->zmq_socket, envelope, message, frames);
+	envelope_free(envelope);
 }
 
-static int handle_message(void* zmq_sock, struct parse_ctx* parser)
+static int handle_message(struct socket_closure* closure)
 {
 	int ret = 0;
 	zmq_msg_t msg;
 	char* message_text = NULL;
+	void* zmq_sock = closure->zmq_socket;
+	GPtrArray* envelope = envelope_new();
+	gboolean in_envelope = TRUE;
+
+	/* NB: Multipart messages arrive all at once, so only the first frame
+	 * can come back EAGAIN */
+	while (TRUE) {
+		zmq_msg_init(&msg);
+		if (zmq_msg_recv(&msg, zmq_sock, ZMQ_DONTWAIT) == -1) {
+			switch (ret = zmq_errno()) {
+			case EAGAIN:
+				goto out;
+			case EINTR:
+				/* We'll pretend we "succeeded" so we'll look for a new message */
+				ret = 0;
+				goto out;
+			default:
+				g_warning("Failed to recieve message: 0x%x (%s)", ret, zmq_strerror(ret));
+				goto out;
+			}
+		}
 
-	zmq_msg_init(&msg);
-	if (zmq_msg_recv(&msg, zmq_sock, ZMQ_DONTWAIT) == -1) {
-		switch (ret = zmq_errno()) {
-		case EAGAIN:
-			goto out;
-		case EINTR:
-			/* We'll pretend we "succeeded" so we'll look for a new message */
-			ret = 0;
-			goto out;
-		default:
-			g_warning("Failed to recieve message: 0x%x (%s)", ret, zmq_strerror(ret));
-			goto out;
+		if (in_envelope) {
+			GByteArray* frame = g_byte_array_sized_new(zmq_msg_size(&msg));
+			g_byte_array_append(frame, zmq_msg_data(&msg), zmq_msg_size(&msg));
+			g_ptr_array_add(envelope, frame);
+
+			/* The empty delimiter ends the envelope */
+			in_envelope = (zmq_msg_size(&msg) > 0);
+		} else if (!message_text) {
+			message_text = g_new0(char, zmq_msg_size(&msg) + 1);
+			memcpy(message_text, zmq_msg_data(&msg), zmq_msg_size(&msg));
 		}
+
+		if (!util_zmq_has_more(zmq_sock)) break;
+		zmq_msg_close(&msg);
 	}
 
-	message_text = g_new0(char, zmq_msg_size(&msg) + 1);
-	memcpy(message_text, zmq_msg_data(&msg), zmq_msg_size(&msg));
+	if (!message_text) {
+		g_warning("Dropping request without a body");
+		goto out;
+	}
 
-	char* data = parse_message(parser, message_text);
-	g_warning("About to send reply: %s", data);
+	TRACE(TRACE_LEVEL_DEBUG, TRACE_REQUEST, NULL, message_text, strlen(message_text));
+	char* data = parse_message(closure->parse_ctx, message_text, envelope);
 
-	zmq_msg_t rep_msg;
-	zmq_msg_init_data(&rep_msg, (void*)data, sizeof(char) * strlen(data), util_zmq_glib_free, NULL);
-	zmq_msg_send(&rep_msg, zmq_sock, 0);
-	zmq_msg_close(&rep_msg);
+	/* The envelope goes with the reply when it gets sent later */
+	if (!data) {
+		envelope = NULL;
+		goto out;
+	}
+
+	send_reply(zmq_sock, envelope, data, NULL);
 
 out:
+	if (envelope) envelope_free(envelope);
 	if (message_text) g_free(message_text);
 	zmq_msg_close(&msg);
 	return ret;
@@ -132,10 +266,23 @@ static int handle_pubsub_message(void* zmq_sock)
 		}
 	}
 
+	/* [topic, message] - print the topic and then the rest of the frames */
 	message_text = g_new0(char, zmq_msg_size(&msg) + 1);
 	memcpy(message_text, zmq_msg_data(&msg), zmq_msg_size(&msg));
+	g_print("%s", message_text);
+
+	while (util_zmq_has_more(zmq_sock)) {
+		zmq_msg_close(&msg);
+		zmq_msg_init(&msg);
+
+		if (zmq_msg_recv(&msg, zmq_sock, 0) == -1) {
+			break;
+		}
+
+		g_print(" %.*s", (int)zmq_msg_size(&msg), (char*)zmq_msg_data(&msg));
+	}
 
-	g_print("%s\n", message_text);
+	g_print("\n");
 
 out:
 	if (message_text) g_free(message_text);
@@ -143,32 +290,50 @@ out:
 	return ret;
 }
 
-static gboolean handle_incoming_messages(gpointer user_data)
+static gboolean handle_incoming_messages(void* zmq_sock, gpointer user_data)
 {
-	struct timer_closure* closure = (struct timer_closure*) user_data;
-
-	if (closure->should_quit) {
-		g_main_loop_quit(closure->main_loop);
-		return FALSE;
-	}
+	struct socket_closure* closure = (struct socket_closure*) user_data;
 
 	if (closure->pubsub_mode) {
-		while (handle_pubsub_message(closure->zmq_socket) == 0) {
+		while (handle_pubsub_message(zmq_sock) == 0) {
 			g_debug("Processing new message");
 		}
 	} else {
-		while (handle_message(closure->zmq_socket, closure->parse_ctx) == 0) {
+		/* Anything we don't get to now is still there next time we're
+		 * dispatched, since we check ZMQ_EVENTS before polling again */
+		for (int i = 0; i < MAX_REQUESTS_PER_WAKEUP && handle_message(closure) == 0; i++) {
 			g_debug("Processing new message");
+
+			/* QUIT is handled by one of the message handlers */
+			if (closure->should_quit) break;
 		}
 	}
 
+	if (closure->should_quit) {
+		g_main_loop_quit(closure->main_loop);
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
-static gboolean handle_sigint(void* shouldquit)
+static gboolean publish_stats(gpointer user_data)
 {
-	gboolean* should_quit = shouldquit;
-	*should_quit = TRUE;
+	struct op_services* services = (struct op_services*)user_data;
+	char* snapshot = stats_snapshot(services->stats);
+
+	pubsub_send_printf(services->pub_sub, "stats", "STATS\n%s", snapshot);
+
+	g_free(snapshot);
+	return TRUE;
+}
+
+static gboolean handle_sigint(void* user_data)
+{
+	struct socket_closure* closure = (struct socket_closure*) user_data;
+
+	closure->should_quit = TRUE;
+	g_main_loop_quit(closure->main_loop);
 
 	return TRUE;
 }
@@ -177,10 +342,14 @@ static void* create_server_socket(void* zmq_ctx, int icecast_port)
 {
 	void* sock;
 	void* ret = NULL;
-	char* address = zeromq_address_from_port("127.0.0.1", icecast_port);
+	char* address = util_zmq_address_from_port("127.0.0.1", icecast_port);
 
 	int linger = 5*1000;
-	sock = zmq_socket(zmq_ctx, ZMQ_REP);
+
+	/* ROUTER rather than REP, so we can have more than one request in
+	 * flight and answer them in whatever order they finish. REQ clients
+	 * can't tell the difference. */
+	sock = zmq_socket(zmq_ctx, ZMQ_ROUTER);
 
 	if (!sock) {
 		g_warning("Failing to create socket %s", zmq_strerror(zmq_errno()));
@@ -203,7 +372,7 @@ out:
 
 static void* create_pubsub_socket(void* zmq_ctx, int icecast_port)
 {
-	char* repreq_addr = zeromq_address_from_port("127.0.0.1", icecast_port);
+	char* repreq_addr = util_zmq_address_from_port("127.0.0.1", icecast_port);
 	char* pubsub_addr = NULL;
 	void* ret = NULL;
 	int linger = 5*1000;
@@ -227,7 +396,16 @@ static void* create_pubsub_socket(void* zmq_ctx, int icecast_port)
 	}
 
 	zmq_setsockopt(ret, ZMQ_LINGER, &linger, sizeof(int));
-	zmq_setsockopt(ret, ZMQ_SUBSCRIBE, NULL, 0);
+
+	/* Let ZeroMQ throw away the topics we didn't ask for */
+	if (!pubsub_filters) {
+		zmq_setsockopt(ret, ZMQ_SUBSCRIBE, NULL, 0);
+	} else {
+		for (guint i = 0; i < pubsub_filters->len; i++) {
+			const char* filter = g_ptr_array_index(pubsub_filters, i);
+			zmq_setsockopt(ret, ZMQ_SUBSCRIBE, filter, strlen(filter));
+		}
+	}
 
 	if (zmq_connect(ret, pubsub_addr+3) == -1) {
 		g_warning("Failed to connect to PubSub on address %s: %s", pubsub_addr, zmq_strerror(zmq_errno()));
@@ -242,6 +420,29 @@ out:
 	return ret;
 }
 
+static struct tag_cache* create_tag_cache(void)
+{
+	struct tag_cache* ret;
+	char* path = tag_cache_path;
+
+	/* Each daemon appends to its cache without locking, so instances
+	 * on different ports get their own file */
+	if (!path) {
+		char* dir = g_build_filename(g_get_user_cache_dir(), "gst-playd", NULL);
+		char* file = g_strdup_printf("tags-%d.cache", icecast_port);
+		g_mkdir_with_parents(dir, 0755);
+
+		path = g_build_filename(dir, file, NULL);
+		g_free(file);
+		g_free(dir);
+	}
+
+	ret = tag_cache_new(path, tag_cache_size);
+
+	if (path != tag_cache_path) g_free(path);
+	return ret;
+}
+
 int main (int argc, char **argv)
 {
 	int ret = 0;
@@ -250,7 +451,8 @@ int main (int argc, char **argv)
 	GOptionContext* ctx;
 
 	void* zmq_ctx = NULL;
-	struct op_services services;
+	struct op_services services = { NULL, };
+	struct socket_closure closure = { NULL, NULL, NULL, FALSE, FALSE, };
 
 	char cwd[4096];
 	getcwd(cwd, sizeof(char) * 4096);
@@ -269,13 +471,24 @@ int main (int argc, char **argv)
 		goto out;
 	}
 
+	if (!output_queue_policy_parse(queue_policy, &services.queue_policy)) {
+		g_warning("Unknown queue policy %s", queue_policy);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!(services.mix_caps = gsu_mix_format_caps(mix_format))) {
+		g_warning("Unknown mix format %s", mix_format);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
 	zmq_ctx = zmq_ctx_new();
 
-	struct timer_closure closure = { NULL, NULL, NULL, FALSE, FALSE, };
 	services.should_quit = &closure.should_quit;
 
 	if (client_message) {
-		char* address = zeromq_address_from_port("127.0.0.1", icecast_port);
+		char* address = util_zmq_address_from_port("127.0.0.1", icecast_port);
 		char* msg = util_send_reqrep_msg(zmq_ctx, client_message, address);
 
 		if (msg) {
@@ -295,22 +508,39 @@ int main (int argc, char **argv)
 
 		closure.pubsub_mode = TRUE;
 	} else {
-		if (!(services.pub_sub = pubsub_new(zmq_ctx, icecast_port))) {
+		services.stats = stats_new();
+
+		if (!(services.pub_sub = pubsub_new(zmq_ctx, icecast_port, services.stats))) {
 			goto out;
 		}
 
+		services.tag_cache = create_tag_cache();
+		services.tag_workers = tag_workers;
+		services.source_pool_size = source_pool_size;
+		services.icecast_host = icecast_host;
+		services.icecast_port = icecast_server_port;
+		services.icecast_password = icecast_password;
+		services.render_path = render_path;
+		services.position_interval = position_interval;
+
 		for (struct parser_plugin_entry* pp_entry = parser_operations; pp_entry->friendly_name; pp_entry++) {
 			pp_entry->context = &services;
 		}
  
 		struct parse_ctx* parser = parse_new();
-		
+		parse_set_stats(parser, services.stats);
+
 		for (struct parser_plugin_entry* op = parser_operations; op->friendly_name; op++) {
 			parse_register_plugin(parser, op);
 		}
 
 		closure.zmq_socket = create_server_socket(zmq_ctx, icecast_port);
 		closure.parse_ctx = parser;
+		parse_set_reply_func(parser, send_deferred_reply, &closure);
+
+		if (stats_interval > 0) {
+			g_timeout_add_seconds(stats_interval, publish_stats, &services);
+		}
 	}
 
 	/* Server Mainloop */
@@ -318,11 +548,15 @@ int main (int argc, char **argv)
 	GMainLoop* main_loop = g_main_loop_new(NULL, FALSE);
 	closure.main_loop = main_loop;
 
-	g_timeout_add(250, handle_incoming_messages, &closure);
+	/* Wake up only when the socket actually has something for us */
+	if (!zms_add_watch(closure.zmq_socket, handle_incoming_messages, &closure)) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
 
 #ifdef G_OS_UNIX
-	g_unix_signal_add(SIGINT, handle_sigint, &closure.should_quit);
-	g_unix_signal_add(SIGTERM, handle_sigint, &closure.should_quit);
+	g_unix_signal_add(SIGINT, handle_sigint, &closure);
+	g_unix_signal_add(SIGTERM, handle_sigint, &closure);
 #endif
 
 	g_warning("Starting Main Loop");
@@ -332,12 +566,16 @@ int main (int argc, char **argv)
 	if (!pubsub_listen) {
 		parse_free(closure.parse_ctx);
 		pubsub_free(services.pub_sub);
+		tag_cache_free(services.tag_cache);
 	}
 
 out:
+	stats_free(services.stats);
+	if (services.mix_caps) gst_caps_unref(services.mix_caps);
 	if (closure.zmq_socket) util_close_socket(closure.zmq_socket);
 	if (zmq_ctx) zmq_ctx_destroy(zmq_ctx);
 
+	if (pubsub_filters) g_ptr_array_free(pubsub_filters, TRUE);
 	g_option_context_free(ctx);
 	return ret;
 }
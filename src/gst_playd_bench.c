@@ -0,0 +1,602 @@
+/*
+   gst_playd_bench - Load generator for a running gst_playd
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <zmq.h>
+
+#include "utility.h"
+
+#define EXIT_FAILURE 1
+
+/* How long to wait for stragglers once the run is over */
+#define DRAIN_TIMEOUT_USEC (5 * G_USEC_PER_SEC)
+
+/* Don't let the poll sleep through more than this much of the schedule */
+#define MAX_POLL_MSEC 10
+
+enum bench_verb {
+	BENCH_PING,
+	BENCH_PLAY,
+	BENCH_STOP,
+	BENCH_TAGS,
+	BENCH_CYCLE,
+	BENCH_VERB_COUNT,
+};
+
+static const char* verb_names[BENCH_VERB_COUNT] = { "PING", "PLAY", "STOP", "TAGS", "CYCLE" };
+
+struct bench_client {
+	void* sock;
+	gboolean busy;
+	enum bench_verb verb;
+	gint64 scheduled_at;
+
+	/* A CYCLE is a PLAY and then a STOP of what it started, timed as
+	 * one; this is the id while the STOP is out */
+	guint64 cycle_id;
+};
+
+struct bench_stats {
+	GArray* latencies;	/* of gint64, usec */
+	guint failures;
+	guint64 bytes;		/* of replies, every frame included */
+};
+
+struct bench_ctx {
+	struct bench_client* clients;
+	int n_clients;
+
+	guint weights[BENCH_VERB_COUNT];
+	guint total_weight;
+
+	GQueue player_ids;	/* of guint64*, from PLAY replies, for STOP to use up */
+	GQueue schedule;	/* of gint64 send times that haven't gone out yet */
+
+	struct bench_stats stats[BENCH_VERB_COUNT];
+	guint64 sent;
+	guint64 received;
+	guint64 max_backlog;
+
+	void* sub;		/* with --events */
+	guint64 events;
+	guint64 event_bytes;
+};
+
+static int icecast_port = 8000;
+static int n_clients = 8;
+static int rate = 1000;
+static int duration = 10;
+static char* mix = "ping=70,play=10,stop=10,tags=10";
+static char* uri = NULL;
+static char* tags_flags = NULL;
+static gboolean listen_events = FALSE;
+
+static GOptionEntry entries[] = {
+	 { "port", 'p', 0, G_OPTION_ARG_INT, &icecast_port, "The port gst_playd was started with", NULL },
+	 { "clients", 'c', 0, G_OPTION_ARG_INT, &n_clients, "Number of client connections (default 8)", "N" },
+	 { "rate", 'r', 0, G_OPTION_ARG_INT, &rate, "Requests per second to aim for, 0 for as fast as the clients can go (default 1000)", "N" },
+	 { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "How many seconds to run for (default 10)", "SECS" },
+	 { "mix", 'm', 0, G_OPTION_ARG_STRING, &mix, "Relative weight of each command (default ping=70,play=10,stop=10,tags=10); cycle is a PLAY followed by a STOP of the same source", "MIX" },
+	 { "uri", 'u', 0, G_OPTION_ARG_STRING, &uri, "Media URI to PLAY and TAGS", "URI" },
+	 { "tags-flags", 't', 0, G_OPTION_ARG_STRING, &tags_flags, "Flags to send with every TAGS, e.g. \"-msgpack\" or \"-binary -noimages\", to compare reply encodings", "FLAGS" },
+	 { "events", 'e', 0, G_OPTION_ARG_NONE, &listen_events, "Also subscribe to the event stream and measure its throughput (every PING publishes one)", NULL },
+	 { NULL }
+};
+
+static gboolean bench_parse_mix(struct bench_ctx* ctx, const char* str)
+{
+	gboolean ret = FALSE;
+	char** pairs = g_strsplit(str, ",", -1);
+	char** iter;
+
+	memset(ctx->weights, 0, sizeof(ctx->weights));
+	ctx->total_weight = 0;
+
+	for (iter = pairs; *iter; iter++) {
+		char* eq = strchr(*iter, '=');
+		int i;
+
+		if (!eq) {
+			g_warning("Expected <command>=<weight>, got %s", *iter);
+			goto out;
+		}
+
+		*eq = '\0';
+		for (i = 0; i < BENCH_VERB_COUNT; i++) {
+			if (!g_ascii_strcasecmp(*iter, verb_names[i])) break;
+		}
+
+		if (i == BENCH_VERB_COUNT) {
+			g_warning("Unknown command %s", *iter);
+			goto out;
+		}
+
+		ctx->weights[i] = atoi(eq + 1);
+		ctx->total_weight += ctx->weights[i];
+	}
+
+	ret = (ctx->total_weight > 0);
+
+out:
+	g_strfreev(pairs);
+	return ret;
+}
+
+static enum bench_verb bench_pick_verb(struct bench_ctx* ctx)
+{
+	guint roll = g_random_int_range(0, ctx->total_weight);
+	int i;
+
+	for (i = 0; i < BENCH_VERB_COUNT; i++) {
+		if (roll < ctx->weights[i]) break;
+		roll -= ctx->weights[i];
+	}
+
+	/* Can't STOP what we haven't started yet */
+	if (i == BENCH_STOP && g_queue_is_empty(&ctx->player_ids)) {
+		return BENCH_PING;
+	}
+
+	return (enum bench_verb)i;
+}
+
+/* Takes ownership of text */
+static gboolean bench_send_text(struct bench_client* client, char* text)
+{
+	zmq_msg_t msg;
+	int rc;
+
+	zmq_msg_init_data(&msg, text, strlen(text), util_zmq_glib_free, NULL);
+	rc = zmq_msg_send(&msg, client->sock, 0);
+	zmq_msg_close(&msg);
+
+	if (rc == -1) {
+		g_warning("Failed to send: %s", zmq_strerror(zmq_errno()));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean bench_send(struct bench_ctx* ctx, struct bench_client* client, enum bench_verb verb, gint64 scheduled_at)
+{
+	char* text = NULL;
+
+	client->verb = verb;
+	client->cycle_id = 0;
+
+	switch (client->verb) {
+	case BENCH_PING:
+		text = g_strdup("PING bench");
+		break;
+	case BENCH_PLAY:
+	case BENCH_CYCLE:
+		text = g_strdup_printf("PLAY %s", uri);
+		break;
+	case BENCH_STOP: {
+		guint64* id = g_queue_pop_head(&ctx->player_ids);
+		text = g_strdup_printf("STOP %" G_GUINT64_FORMAT, *id);
+		g_free(id);
+		break;
+	}
+	case BENCH_TAGS:
+		text = (tags_flags ? g_strdup_printf("TAGS %s %s", tags_flags, uri) : g_strdup_printf("TAGS %s", uri));
+		break;
+	default:
+		g_assert_not_reached();
+	}
+
+	if (!bench_send_text(client, text)) {
+		return FALSE;
+	}
+
+	client->busy = TRUE;
+	client->scheduled_at = scheduled_at;
+	ctx->sent++;
+	return TRUE;
+}
+
+/* OK player id: <id>; 0 if it isn't one */
+static guint64 bench_player_id(zmq_msg_t* msg)
+{
+	char* text = g_strndup(zmq_msg_data(msg), zmq_msg_size(msg));
+	char* id = strrchr(text, ' ');
+	guint64 ret = 0;
+
+	if (id) {
+		ret = g_ascii_strtoull(id + 1, NULL, 10);
+	}
+
+	g_free(text);
+	return ret;
+}
+
+static void bench_receive(struct bench_ctx* ctx, struct bench_client* client, gint64 now)
+{
+	struct bench_stats* stats = &ctx->stats[client->verb];
+	gint64 latency = now - client->scheduled_at;
+	gboolean ok = FALSE;
+	guint64 id = 0;
+	zmq_msg_t msg;
+
+	zmq_msg_init(&msg);
+	if (zmq_msg_recv(&msg, client->sock, 0) == -1) {
+		zmq_msg_close(&msg);
+		return;
+	}
+
+	if (zmq_msg_size(&msg) >= 2 && !memcmp(zmq_msg_data(&msg), "OK", 2)) {
+		ok = TRUE;
+	}
+
+	if (ok && (client->verb == BENCH_PLAY || (client->verb == BENCH_CYCLE && !client->cycle_id))) {
+		id = bench_player_id(&msg);
+	}
+
+	stats->bytes += zmq_msg_size(&msg);
+	zmq_msg_close(&msg);
+
+	/* Replies can carry extra frames; we only time the whole thing */
+	while (util_zmq_has_more(client->sock)) {
+		zmq_msg_init(&msg);
+		zmq_msg_recv(&msg, client->sock, 0);
+		stats->bytes += zmq_msg_size(&msg);
+		zmq_msg_close(&msg);
+	}
+
+	if (id && client->verb == BENCH_PLAY) {
+		g_queue_push_tail(&ctx->player_ids, g_memdup(&id, sizeof(id)));
+	}
+
+	/* Half way through a cycle; the client stays busy and the clock keeps
+	 * running until the STOP comes back */
+	if (client->verb == BENCH_CYCLE && !client->cycle_id) {
+		if (id && bench_send_text(client, g_strdup_printf("STOP %" G_GUINT64_FORMAT, id))) {
+			client->cycle_id = id;
+			return;
+		}
+
+		ok = FALSE;
+	}
+
+	if (!ok) {
+		stats->failures++;
+	}
+
+	g_array_append_val(stats->latencies, latency);
+	client->cycle_id = 0;
+	client->busy = FALSE;
+	ctx->received++;
+}
+
+static void bench_receive_events(struct bench_ctx* ctx)
+{
+	zmq_msg_t msg;
+
+	while (TRUE) {
+		zmq_msg_init(&msg);
+		if (zmq_msg_recv(&msg, ctx->sub, ZMQ_DONTWAIT) == -1) {
+			zmq_msg_close(&msg);
+			return;
+		}
+
+		ctx->event_bytes += zmq_msg_size(&msg);
+		zmq_msg_close(&msg);
+
+		if (!util_zmq_has_more(ctx->sub)) {
+			ctx->events++;
+		}
+	}
+}
+
+static void* bench_subscribe(void* zmq_ctx, const char* address)
+{
+	char* reply = util_send_reqrep_msg(zmq_ctx, "PUBSUB ", address);
+	void* ret = NULL;
+
+	if (!reply || strncmp(reply, "OK ", 3)) {
+		g_warning("Couldn't get the event stream address: %s", (reply ? reply : "no reply"));
+		goto out;
+	}
+
+	if (!(ret = zmq_socket(zmq_ctx, ZMQ_SUB))) {
+		goto out;
+	}
+
+	zmq_setsockopt(ret, ZMQ_SUBSCRIBE, NULL, 0);
+	if (zmq_connect(ret, reply + 3) == -1) {
+		g_warning("Failed to connect to %s: %s", reply + 3, zmq_strerror(zmq_errno()));
+		util_close_socket(ret);
+		ret = NULL;
+	}
+
+out:
+	g_free(reply);
+	return ret;
+}
+
+static gint compare_latency(gconstpointer lhs, gconstpointer rhs)
+{
+	gint64 l = *(const gint64*)lhs;
+	gint64 r = *(const gint64*)rhs;
+
+	return (l > r) - (l < r);
+}
+
+static double percentile_msec(GArray* sorted, double p)
+{
+	guint index;
+
+	if (sorted->len == 0) {
+		return 0.0;
+	}
+
+	index = (guint)(p * (sorted->len - 1) + 0.5);
+	return g_array_index(sorted, gint64, index) / 1000.0;
+}
+
+static void bench_report_line(const char* name, GArray* latencies, guint failures, guint64 bytes, double elapsed)
+{
+	g_array_sort(latencies, compare_latency);
+
+	g_print("%-6s %9u %9.1f %7u %9.3f %9.3f %9.3f %9.3f %9.0f\n", name, latencies->len, latencies->len / elapsed, failures,
+		percentile_msec(latencies, 0.50), percentile_msec(latencies, 0.99),
+		percentile_msec(latencies, 0.999), percentile_msec(latencies, 1.0),
+		latencies->len ? bytes / (double)latencies->len : 0.0);
+}
+
+static void bench_report(struct bench_ctx* ctx, double elapsed)
+{
+	GArray* all = g_array_new(FALSE, FALSE, sizeof(gint64));
+	guint failures = 0;
+	guint64 bytes = 0;
+	int i;
+
+	g_print("%-6s %9s %9s %7s %9s %9s %9s %9s %9s\n", "", "replies", "per sec", "failed", "p50 ms", "p99 ms", "p999 ms", "max ms", "avg bytes");
+
+	for (i = 0; i < BENCH_VERB_COUNT; i++) {
+		struct bench_stats* stats = &ctx->stats[i];
+
+		if (stats->latencies->len == 0) {
+			continue;
+		}
+
+		g_array_append_vals(all, stats->latencies->data, stats->latencies->len);
+		failures += stats->failures;
+		bytes += stats->bytes;
+
+		bench_report_line(verb_names[i], stats->latencies, stats->failures, stats->bytes, elapsed);
+	}
+
+	bench_report_line("all", all, failures, bytes, elapsed);
+
+	g_print("\nsent: %" G_GUINT64_FORMAT " replies: %" G_GUINT64_FORMAT " elapsed: %.2fs throughput: %.1f replies/s max backlog: %" G_GUINT64_FORMAT "\n",
+		ctx->sent, ctx->received, elapsed, ctx->received / elapsed, ctx->max_backlog);
+
+	if (ctx->sub) {
+		g_print("events: %" G_GUINT64_FORMAT " (%.1f/s, %.1f KB/s)\n",
+			ctx->events, ctx->events / elapsed, ctx->event_bytes / elapsed / 1024.0);
+	}
+
+	g_array_free(all, TRUE);
+}
+
+/* Requests go out on a fixed schedule and are timed from when they were
+ * *supposed* to go out, so that a daemon that stalls gets charged for the
+ * requests that piled up behind the stall instead of hiding them */
+static void bench_run(struct bench_ctx* ctx)
+{
+	zmq_pollitem_t* items = g_new0(zmq_pollitem_t, ctx->n_clients + 1);
+	struct bench_client** polled = g_new0(struct bench_client*, ctx->n_clients);
+	gint64 interval = (rate > 0 ? G_USEC_PER_SEC / rate : 0);
+	gint64 started_at = g_get_monotonic_time();
+	gint64 ends_at = started_at + (gint64)duration * G_USEC_PER_SEC;
+	gint64 next_send = started_at;
+	gint64 now;
+	int i, n_busy;
+
+	while (TRUE) {
+		now = g_get_monotonic_time();
+
+		if (now < ends_at) {
+			if (interval) {
+				while (next_send <= now) {
+					g_queue_push_tail(&ctx->schedule, g_memdup(&next_send, sizeof(gint64)));
+					next_send += interval;
+				}
+			}
+
+			for (i = 0; i < ctx->n_clients; i++) {
+				struct bench_client* client = &ctx->clients[i];
+				gint64 scheduled_at = now;
+
+				if (client->busy) continue;
+
+				if (interval) {
+					gint64* next = g_queue_pop_head(&ctx->schedule);
+					if (!next) break;
+
+					scheduled_at = *next;
+					g_free(next);
+				}
+
+				bench_send(ctx, client, bench_pick_verb(ctx), scheduled_at);
+			}
+
+			ctx->max_backlog = MAX(ctx->max_backlog, g_queue_get_length(&ctx->schedule));
+		}
+
+		n_busy = 0;
+		for (i = 0; i < ctx->n_clients; i++) {
+			if (!ctx->clients[i].busy) continue;
+
+			polled[n_busy] = &ctx->clients[i];
+			items[n_busy].socket = ctx->clients[i].sock;
+			items[n_busy].events = ZMQ_POLLIN;
+			items[n_busy].revents = 0;
+			n_busy++;
+		}
+
+		if (now >= ends_at && (n_busy == 0 || now >= ends_at + DRAIN_TIMEOUT_USEC)) {
+			break;
+		}
+
+		if (n_busy == 0) {
+			g_usleep(CLAMP(next_send - now, 0, MAX_POLL_MSEC * 1000));
+			continue;
+		}
+
+		if (ctx->sub) {
+			items[n_busy].socket = ctx->sub;
+			items[n_busy].events = ZMQ_POLLIN;
+			items[n_busy].revents = 0;
+		}
+
+		if (zmq_poll(items, n_busy + (ctx->sub ? 1 : 0), MAX_POLL_MSEC * ZMQ_POLL_MSEC) == -1) {
+			g_warning("Poll failed: %s", zmq_strerror(zmq_errno()));
+			break;
+		}
+
+		now = g_get_monotonic_time();
+		for (i = 0; i < n_busy; i++) {
+			if (items[i].revents & ZMQ_POLLIN) {
+				bench_receive(ctx, polled[i], now);
+			}
+		}
+
+		if (ctx->sub) {
+			bench_receive_events(ctx);
+		}
+	}
+
+	bench_report(ctx, (g_get_monotonic_time() - started_at) / (double)G_USEC_PER_SEC);
+
+	g_free(polled);
+	g_free(items);
+}
+
+int main (int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+
+	GError* err = NULL;
+	GOptionContext* option_ctx;
+
+	void* zmq_ctx = NULL;
+	char* address = NULL;
+	struct bench_ctx ctx;
+	gpointer to_free;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	option_ctx = g_option_context_new(" - Load generator for gst_playd");
+	g_option_context_add_main_entries(option_ctx, entries, "");
+
+	if (!g_option_context_parse(option_ctx, &argc, &argv, &err)) {
+		g_warning("Option parsing failed: %s", err->message);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!bench_parse_mix(&ctx, mix) || n_clients < 1 || duration < 1 || rate < 0) {
+		g_warning("Invalid options, see --help");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!uri && (ctx.weights[BENCH_PLAY] || ctx.weights[BENCH_TAGS] || ctx.weights[BENCH_CYCLE])) {
+		g_warning("PLAY, TAGS and CYCLE need a --uri to work with");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	zmq_ctx = zmq_ctx_new();
+	address = util_zmq_address_from_port("127.0.0.1", icecast_port);
+
+	ctx.n_clients = n_clients;
+	ctx.clients = g_new0(struct bench_client, n_clients);
+
+	for (i = 0; i < BENCH_VERB_COUNT; i++) {
+		ctx.stats[i].latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+	}
+
+	for (i = 0; i < n_clients; i++) {
+		if (!(ctx.clients[i].sock = util_connect_req_socket(zmq_ctx, address))) {
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	if (listen_events && !(ctx.sub = bench_subscribe(zmq_ctx, address))) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (rate) {
+		g_print("%d clients against %s, %d req/s for %ds, mix %s\n\n", n_clients, address, rate, duration, mix);
+	} else {
+		g_print("%d clients against %s, flat out for %ds, mix %s\n\n", n_clients, address, duration, mix);
+	}
+
+	bench_run(&ctx);
+
+	/* Don't leave anything we started playing behind */
+	for (i = 0; i < ctx.n_clients && !g_queue_is_empty(&ctx.player_ids); i++) {
+		struct bench_client* client = &ctx.clients[i];
+
+		while (!client->busy && !g_queue_is_empty(&ctx.player_ids)) {
+			if (!bench_send(&ctx, client, BENCH_STOP, g_get_monotonic_time())) break;
+			bench_receive(&ctx, client, g_get_monotonic_time());
+		}
+	}
+
+out:
+	if (ctx.clients) {
+		for (i = 0; i < ctx.n_clients; i++) {
+			if (ctx.clients[i].sock) util_close_socket(ctx.clients[i].sock);
+		}
+
+		g_free(ctx.clients);
+	}
+
+	for (i = 0; i < BENCH_VERB_COUNT; i++) {
+		if (ctx.stats[i].latencies) g_array_free(ctx.stats[i].latencies, TRUE);
+	}
+
+	while ((to_free = g_queue_pop_head(&ctx.schedule))) {
+		g_free(to_free);
+	}
+
+	while ((to_free = g_queue_pop_head(&ctx.player_ids))) {
+		g_free(to_free);
+	}
+
+	if (ctx.sub) util_close_socket(ctx.sub);
+
+	g_free(address);
+	if (zmq_ctx) zmq_ctx_destroy(zmq_ctx);
+
+	g_option_context_free(option_ctx);
+	return ret;
+}
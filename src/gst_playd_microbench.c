@@ -0,0 +1,347 @@
+/*
+   gst_playd_microbench - Times gst_playd's hot paths without a daemon
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "parser.h"
+#include "stats.h"
+#include "uuencode.h"
+
+#define EXIT_FAILURE 1
+
+/* Checking the clock every call would cost more than some of what we're
+ * timing */
+#define CALLS_PER_CLOCK_CHECK 4096
+
+static int duration = 3;
+static gboolean bench_parse = FALSE;
+static gboolean bench_base64 = FALSE;
+static int base64_checks = 200000;
+
+static GOptionEntry entries[] = {
+	 { "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "How many seconds to run each benchmark for (default 3)", "SECS" },
+	 { "parse", 0, 0, G_OPTION_ARG_NONE, &bench_parse, "Time parse_message on a mix of typical requests", NULL },
+	 { "base64", 0, 0, G_OPTION_ARG_NONE, &bench_base64, "Check the base64 vector kernels against the plain C code, then time each of them", NULL },
+	 { "base64-checks", 0, 0, G_OPTION_ARG_INT, &base64_checks, "Number of random inputs to check each kernel with (default 200000)", "N" },
+	 { NULL }
+};
+
+/*
+ * parse_message
+ */
+
+static char* bench_op_parse(const char* param, void* ctx)
+{
+	return g_strdup("OK");
+}
+
+/* Same verbs as the daemon registers, so the table search is as deep */
+static struct message_dispatch_entry bench_messages[] = {
+	{ "PUBSUB", bench_op_parse },
+	{ "QUIT", bench_op_parse },
+	{ "STATS", bench_op_parse },
+	{ "TRACE", bench_op_parse },
+	{ "PING", bench_op_parse },
+	{ "PLAY", bench_op_parse },
+	{ "PRELOAD", bench_op_parse },
+	{ "STOP", bench_op_parse },
+	{ "DUMPGRAPH", bench_op_parse },
+	{ "POOL", bench_op_parse },
+	{ "MOUNT", bench_op_parse },
+	{ "UNMOUNT", bench_op_parse },
+	{ "TARGETS", bench_op_parse },
+	{ "RENDER", bench_op_parse },
+	{ "CLOCK", bench_op_parse },
+	{ "FADE", bench_op_parse },
+	{ "CROSSFADE", bench_op_parse },
+	{ "TAGS", bench_op_parse },
+	{ "TAGCACHE", bench_op_parse },
+	{ "SCAN", bench_op_parse },
+	{ NULL },
+};
+
+static void* bench_plugin_new(void* ctx)
+{
+	return ctx;
+}
+
+static gboolean bench_plugin_register(void* ctx, struct message_dispatch_entry** entries)
+{
+	*entries = bench_messages;
+	return TRUE;
+}
+
+static void bench_plugin_free(void* ctx)
+{
+}
+
+static struct parser_plugin_entry bench_plugin = {
+	"Bench", NULL, bench_plugin_new, bench_plugin_register, bench_plugin_free,
+};
+
+static const char* parse_requests[] = {
+	"PING bench",
+	"PLAY file:///home/foo/Music/Some%20Artist/Some%20Album/01%20Track.mp3",
+	"STOP 65537",
+	"TAGS file:///home/foo/Music/Some%20Artist/Some%20Album/02%20Track.mp3",
+	"STATS ",
+	"FADE 65537 0.5 2000",
+	"NOTAVERB at all",
+};
+
+static void run_parse(void)
+{
+	struct parse_ctx* parser = parse_new();
+	struct stats_ctx* stats = stats_new();
+	size_t lens[G_N_ELEMENTS(parse_requests)];
+	char scratch[256];
+	gint64 started_at, elapsed;
+	guint64 calls = 0;
+	guint i;
+
+	/* Every request gets timed in the daemon too */
+	parse_set_stats(parser, stats);
+	parse_register_plugin(parser, &bench_plugin);
+
+	for (i = 0; i < G_N_ELEMENTS(parse_requests); i++) {
+		lens[i] = strlen(parse_requests[i]) + 1;
+	}
+
+	started_at = g_get_monotonic_time();
+	do {
+		for (i = 0; i < CALLS_PER_CLOCK_CHECK; i++) {
+			guint which = i % G_N_ELEMENTS(parse_requests);
+
+			/* parse_message tokenizes in place */
+			memcpy(scratch, parse_requests[which], lens[which]);
+			g_free(parse_message(parser, scratch, NULL));
+		}
+
+		calls += CALLS_PER_CLOCK_CHECK;
+		elapsed = g_get_monotonic_time() - started_at;
+	} while (elapsed < (gint64)duration * G_USEC_PER_SEC);
+
+	g_print("parse_message: %" G_GUINT64_FORMAT " messages in %.2fs, %.0f messages/s, %.1f ns/message\n",
+		calls, elapsed / (double)G_USEC_PER_SEC,
+		calls / (elapsed / (double)G_USEC_PER_SEC), elapsed * 1000.0 / calls);
+
+	parse_free(parser);
+	stats_free(stats);
+}
+
+/*
+ * base64
+ */
+
+/* Large enough to be about memory bandwidth rather than call overhead;
+ * cover art runs to a few hundred KB */
+#define BASE64_BENCH_BYTES (8 << 20)
+
+/* Random inputs stay short so that every tail length gets plenty of runs */
+#define BASE64_CHECK_MAX_LEN 300
+
+static const char* simd_names[] = { "scalar", "ssse3", "avx2" };
+
+/* Sprinkles characters that decoders have to skip (or stop at) through
+ * text, the way line-wrapped or sloppy base64 comes in */
+static char* base64_add_junk(const char* text)
+{
+	static const char junk[] = "\n =!*\x80";
+	size_t len = strlen(text);
+	char* ret = g_malloc(len * 2 + 1);
+	char* out = ret;
+
+	for (size_t i = 0; i < len; i++) {
+		if (g_random_int_range(0, 40) == 0) {
+			*out++ = junk[g_random_int_range(0, sizeof(junk) - 1)];
+		}
+
+		*out++ = text[i];
+	}
+
+	*out = '\0';
+	return ret;
+}
+
+/* Decodes text with the kernel at level, returning the output and where
+ * decode_base64 stopped */
+static guchar* base64_decode_at(int level, const char* text, gsize* len, gsize* stopped_at)
+{
+	guchar* ret = g_malloc(strlen(text) / 4 * 3 + 3);
+	char* out = (char*)ret;
+
+	uuencode_set_simd(level);
+	*stopped_at = decode_base64(&out, text) - text;
+	*len = out - (char*)ret;
+
+	return ret;
+}
+
+static gboolean base64_check(int level)
+{
+	guint failures = 0;
+	int i;
+
+	for (i = 0; i < base64_checks; i++) {
+		int len = g_random_int_range(0, BASE64_CHECK_MAX_LEN + 1);
+		guchar* input = g_malloc(len + 1);
+		char* expected = g_malloc(uuencode_get_length(len) + 1);
+		char* actual = g_malloc(uuencode_get_length(len) + 1);
+		char* text;
+		guchar *dec_expected, *dec_actual;
+		gsize len_expected, len_actual, stop_expected, stop_actual;
+
+		for (int j = 0; j < len; j++) {
+			input[j] = g_random_int_range(0, 256);
+		}
+
+		uuencode_set_simd(UUENCODE_SIMD_NONE);
+		uuencode(expected, input, len, uuenc_tbl_base64);
+		uuencode_set_simd(level);
+		uuencode(actual, input, len, uuenc_tbl_base64);
+
+		if (strcmp(expected, actual)) {
+			if (failures++ < 5) g_print("  encode mismatch at length %d\n", len);
+		}
+
+		/* A third of the decodes get junk mixed in; the rest have to get
+		 * the input back as well as agree with the plain C code */
+		text = (i % 3 == 0 ? base64_add_junk(expected) : g_strdup(expected));
+		dec_expected = base64_decode_at(UUENCODE_SIMD_NONE, text, &len_expected, &stop_expected);
+		dec_actual = base64_decode_at(level, text, &len_actual, &stop_actual);
+
+		if (len_expected != len_actual || stop_expected != stop_actual || memcmp(dec_expected, dec_actual, len_actual)) {
+			if (failures++ < 5) g_print("  decode mismatch on \"%s\"\n", text);
+		} else if (i % 3 && (len_actual != (gsize)len || memcmp(dec_actual, input, len))) {
+			if (failures++ < 5) g_print("  decode didn't round trip at length %d\n", len);
+		}
+
+		g_free(dec_actual);
+		g_free(dec_expected);
+		g_free(text);
+		g_free(actual);
+		g_free(expected);
+		g_free(input);
+	}
+
+	g_print("%-6s %d inputs checked, %u failures\n", simd_names[level], base64_checks, failures);
+	return (failures == 0);
+}
+
+static double base64_time(int level, gboolean decode, const guchar* input, char* text, guchar* output)
+{
+	gint64 started_at, elapsed;
+	guint64 bytes = 0;
+
+	uuencode_set_simd(level);
+
+	started_at = g_get_monotonic_time();
+	do {
+		if (decode) {
+			char* out = (char*)output;
+			decode_base64(&out, text);
+		} else {
+			uuencode(text, input, BASE64_BENCH_BYTES, uuenc_tbl_base64);
+		}
+
+		bytes += BASE64_BENCH_BYTES;
+		elapsed = g_get_monotonic_time() - started_at;
+	} while (elapsed < (gint64)duration * G_USEC_PER_SEC);
+
+	/* Bytes of binary either way, so the two are comparable */
+	return bytes / (elapsed / (double)G_USEC_PER_SEC) / 1e9;
+}
+
+static gboolean run_base64(void)
+{
+	int best = uuencode_get_simd();
+	guchar* input = g_malloc(BASE64_BENCH_BYTES);
+	char* text = g_malloc(uuencode_get_length(BASE64_BENCH_BYTES) + 1);
+	guchar* output = g_malloc(BASE64_BENCH_BYTES + 3);
+	gboolean ret = TRUE;
+	int level;
+
+	for (level = UUENCODE_SIMD_SSSE3; level <= best; level++) {
+		ret = base64_check(level) && ret;
+	}
+
+	if (best == UUENCODE_SIMD_NONE) {
+		g_print("No vector kernels on this CPU, only timing the plain C code\n");
+	}
+
+	for (int i = 0; i < BASE64_BENCH_BYTES; i++) {
+		input[i] = g_random_int_range(0, 256);
+	}
+
+	uuencode_set_simd(UUENCODE_SIMD_NONE);
+	uuencode(text, input, BASE64_BENCH_BYTES, uuenc_tbl_base64);
+
+	g_print("\n%-6s %12s %12s\n", "", "encode GB/s", "decode GB/s");
+	for (level = UUENCODE_SIMD_NONE; level <= best; level++) {
+		double enc = base64_time(level, FALSE, input, text, output);
+		double dec = base64_time(level, TRUE, input, text, output);
+
+		g_print("%-6s %12.2f %12.2f\n", simd_names[level], enc, dec);
+	}
+
+	uuencode_set_simd(best);
+
+	g_free(output);
+	g_free(text);
+	g_free(input);
+	return ret;
+}
+
+int main (int argc, char **argv)
+{
+	int ret = 0;
+
+	GError* err = NULL;
+	GOptionContext* option_ctx;
+
+	option_ctx = g_option_context_new(" - Microbenchmarks for gst_playd");
+	g_option_context_add_main_entries(option_ctx, entries, "");
+
+	if (!g_option_context_parse(option_ctx, &argc, &argv, &err)) {
+		g_warning("Option parsing failed: %s", err->message);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (duration < 1 || base64_checks < 0 || !(bench_parse || bench_base64)) {
+		g_warning("Pick a benchmark to run, see --help");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (bench_parse) run_parse();
+
+	/* Any mismatch fails the run, so this doubles as a check */
+	if (bench_base64 && !run_base64()) {
+		ret = EXIT_FAILURE;
+	}
+
+out:
+	g_option_context_free(option_ctx);
+	return ret;
+}
@@ -0,0 +1,163 @@
+/*
+   msgpack.c - Just enough of a MessagePack writer for replies
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "msgpack.h"
+
+/* Everything multi-byte is big-endian on the wire */
+static void msgpack_write_be(GByteArray* buf, guint8 tag, guint64 value, guint size)
+{
+	guint8 bytes[9];
+
+	bytes[0] = tag;
+	for (guint i = 0; i < size; i++) {
+		bytes[size - i] = (guint8)(value >> (8 * i));
+	}
+
+	g_byte_array_append(buf, bytes, size + 1);
+}
+
+void msgpack_write_nil(GByteArray* buf)
+{
+	guint8 tag = 0xc0;
+	g_byte_array_append(buf, &tag, 1);
+}
+
+void msgpack_write_bool(GByteArray* buf, gboolean value)
+{
+	guint8 tag = (value ? 0xc3 : 0xc2);
+	g_byte_array_append(buf, &tag, 1);
+}
+
+void msgpack_write_uint(GByteArray* buf, guint64 value)
+{
+	guint8 tag;
+
+	if (value < 0x80) {
+		tag = (guint8)value;
+		g_byte_array_append(buf, &tag, 1);
+	} else if (value <= G_MAXUINT8) {
+		msgpack_write_be(buf, 0xcc, value, 1);
+	} else if (value <= G_MAXUINT16) {
+		msgpack_write_be(buf, 0xcd, value, 2);
+	} else if (value <= G_MAXUINT32) {
+		msgpack_write_be(buf, 0xce, value, 4);
+	} else {
+		msgpack_write_be(buf, 0xcf, value, 8);
+	}
+}
+
+void msgpack_write_int(GByteArray* buf, gint64 value)
+{
+	guint8 tag;
+
+	if (value >= 0) {
+		msgpack_write_uint(buf, value);
+	} else if (value >= -32) {
+		tag = (guint8)value;
+		g_byte_array_append(buf, &tag, 1);
+	} else if (value >= G_MININT8) {
+		msgpack_write_be(buf, 0xd0, (guint64)value, 1);
+	} else if (value >= G_MININT16) {
+		msgpack_write_be(buf, 0xd1, (guint64)value, 2);
+	} else if (value >= G_MININT32) {
+		msgpack_write_be(buf, 0xd2, (guint64)value, 4);
+	} else {
+		msgpack_write_be(buf, 0xd3, (guint64)value, 8);
+	}
+}
+
+void msgpack_write_double(GByteArray* buf, double value)
+{
+	guint64 bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	msgpack_write_be(buf, 0xcb, bits, 8);
+}
+
+void msgpack_write_str(GByteArray* buf, const char* str, gsize len)
+{
+	if (len < 32) {
+		guint8 tag = 0xa0 | (guint8)len;
+		g_byte_array_append(buf, &tag, 1);
+	} else if (len <= G_MAXUINT8) {
+		msgpack_write_be(buf, 0xd9, len, 1);
+	} else if (len <= G_MAXUINT16) {
+		msgpack_write_be(buf, 0xda, len, 2);
+	} else {
+		msgpack_write_be(buf, 0xdb, len, 4);
+	}
+
+	g_byte_array_append(buf, (const guint8*)str, len);
+}
+
+void msgpack_write_bin(GByteArray* buf, const guint8* data, gsize len)
+{
+	if (len <= G_MAXUINT8) {
+		msgpack_write_be(buf, 0xc4, len, 1);
+	} else if (len <= G_MAXUINT16) {
+		msgpack_write_be(buf, 0xc5, len, 2);
+	} else {
+		msgpack_write_be(buf, 0xc6, len, 4);
+	}
+
+	g_byte_array_append(buf, data, len);
+}
+
+void msgpack_write_array(GByteArray* buf, guint32 count)
+{
+	if (count < 16) {
+		guint8 tag = 0x90 | (guint8)count;
+		g_byte_array_append(buf, &tag, 1);
+	} else if (count <= G_MAXUINT16) {
+		msgpack_write_be(buf, 0xdc, count, 2);
+	} else {
+		msgpack_write_be(buf, 0xdd, count, 4);
+	}
+}
+
+void msgpack_write_map(GByteArray* buf, guint32 count)
+{
+	if (count < 16) {
+		guint8 tag = 0x80 | (guint8)count;
+		g_byte_array_append(buf, &tag, 1);
+	} else if (count <= G_MAXUINT16) {
+		msgpack_write_be(buf, 0xde, count, 2);
+	} else {
+		msgpack_write_be(buf, 0xdf, count, 4);
+	}
+}
+
+guint msgpack_write_map_placeholder(GByteArray* buf)
+{
+	guint ret = buf->len;
+
+	msgpack_write_be(buf, 0xdf, 0, 4);
+	return ret;
+}
+
+void msgpack_patch_map(GByteArray* buf, guint offset, guint32 count)
+{
+	for (guint i = 0; i < 4; i++) {
+		buf->data[offset + 4 - i] = (guint8)(count >> (8 * i));
+	}
+}
@@ -0,0 +1,45 @@
+/*
+   msgpack.h - Just enough of a MessagePack writer for replies
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _MSGPACK_H
+#define _MSGPACK_H
+
+#include <glib.h>
+
+/* Appends MessagePack (https://msgpack.org) values to a GByteArray, always
+ * using the smallest encoding that fits. Containers are a header followed
+ * by that many values (two per map entry); when the count isn't known up
+ * front, write a placeholder and patch it once it is. */
+
+void msgpack_write_nil(GByteArray* buf);
+void msgpack_write_bool(GByteArray* buf, gboolean value);
+void msgpack_write_int(GByteArray* buf, gint64 value);
+void msgpack_write_uint(GByteArray* buf, guint64 value);
+void msgpack_write_double(GByteArray* buf, double value);
+void msgpack_write_str(GByteArray* buf, const char* str, gsize len);
+void msgpack_write_bin(GByteArray* buf, const guint8* data, gsize len);
+void msgpack_write_array(GByteArray* buf, guint32 count);
+void msgpack_write_map(GByteArray* buf, guint32 count);
+
+/* A fixed-size map header; returns the offset to hand to msgpack_patch_map */
+guint msgpack_write_map_placeholder(GByteArray* buf);
+void msgpack_patch_map(GByteArray* buf, guint offset, guint32 count);
+
+#endif
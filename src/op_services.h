@@ -22,9 +22,27 @@
 #define _OP_SERVICES_H
 
 #include "pubsub.h"
+#include "output.h"
+
+struct tag_cache;
+struct stats_ctx;
 
 struct op_services {
 	struct pubsub_ctx* pub_sub;
+	struct stats_ctx* stats;
+	struct tag_cache* tag_cache;
+	int tag_workers;
+	int source_pool_size;
+
+	const char* icecast_host;
+	int icecast_port;
+	const char* icecast_password;
+	struct output_queue_policy queue_policy;
+	const char* render_path;
+
+	/* What every source is converted to before it hits the mixer */
+	GstCaps* mix_caps;
+	int position_interval;
 	gboolean* should_quit;
 };
 
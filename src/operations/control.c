@@ -19,18 +19,25 @@
 */
 
 #include <glib.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "parser.h"
 #include "ping.h"
 #include "utility.h"
 #include "op_services.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "operations/control.h"
 
+#define TRACE_DEFAULT_RECORDS 200
+
 static struct message_dispatch_entry control_messages[] = {
 	{ "PUBSUB", op_pubsub_parse },
 	{ "QUIT", op_quit_parse },
+	{ "STATS", op_stats_parse },
+	{ "TRACE", op_trace_parse },
 	{ NULL },
 };
 
@@ -62,3 +69,42 @@ char* op_quit_parse(const char* param, void* ctx)
 
 	return strdup("OK");
 }
+
+char* op_stats_parse(const char* param, void* ctx)
+{
+	struct op_services* services = (struct op_services*)ctx;
+	char* snapshot = stats_snapshot(services->stats);
+	char* ret = g_strdup_printf("OK\n%s", snapshot);
+
+	g_free(snapshot);
+	return ret;
+}
+
+/* TRACE [count] - the last count trace records across all threads
+ *
+ * NB: A verb needs a space after it to be parsed, so a bare TRACE comes
+ * in as "TRACE " with a blank param */
+char* op_trace_parse(const char* param, void* ctx)
+{
+	guint count = TRACE_DEFAULT_RECORDS;
+	char* arg = g_strstrip(g_strdup(param ? param : ""));
+	char* end;
+	char* records;
+	char* ret;
+
+	if (*arg) {
+		count = strtoul(arg, &end, 10);
+		if (*end || count == 0) {
+			ret = g_strdup_printf("FAIL Invalid record count: %s", arg);
+			goto out;
+		}
+	}
+
+	records = trace_decode(count);
+	ret = g_strdup_printf("OK\n%s", records);
+	g_free(records);
+
+out:
+	g_free(arg);
+	return ret;
+}
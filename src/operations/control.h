@@ -24,6 +24,8 @@
 void* op_control_new(void*);
 char* op_pubsub_parse(const char* param, void*);
 char* op_quit_parse(const char* param, void* ctx);
+char* op_stats_parse(const char* param, void* ctx);
+char* op_trace_parse(const char* param, void* ctx);
 gboolean op_control_register(void* ctx, struct message_dispatch_entry** entries);
 void op_control_free(void* ctx);
 
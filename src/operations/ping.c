@@ -55,6 +55,6 @@ char* op_ping_parse(const char* param, void* ctx)
 	if (!param) param = "(none)";
 	char* ret = g_strdup_printf("OK Message was %s", param);
 
-	pubsub_send_message(services->pub_sub, ret);
+	pubsub_send_message(services->pub_sub, "ping", ret);
 	return ret;
 }
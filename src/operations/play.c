@@ -20,28 +20,75 @@
 
 #include <glib.h>
 #include <string.h>
+#include <time.h>
 
 #include "parser.h"
 #include "utility.h"
 #include "gst-util.h"
 #include "op_services.h"
+#include "slot-table.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "operations/play.h"
 
 static struct message_dispatch_entry playback_messages[] = {
-	{ "TAGS", op_tags_parse },
 	{ "PLAY", op_play_parse },
+	{ "PRELOAD", op_preload_parse },
 	{ "STOP", op_stop_parse },
 	{ "DUMPGRAPH", op_dumpgraph_parse },
+	{ "POOL", op_pool_parse },
+	{ "MOUNT", op_mount_parse },
+	{ "UNMOUNT", op_unmount_parse },
+	{ "TARGETS", op_targets_parse },
+	{ "RENDER", op_render_parse },
+	{ "CLOCK", op_clock_parse },
+	{ "FADE", op_fade_parse },
+	{ "CROSSFADE", op_crossfade_parse },
 	{ NULL },
 };
 
+/* A linear gain ramp in a source's own time: from at start, to from
+ * start + duration on */
+struct gain_ramp {
+	gdouble from;
+	gdouble to;
+	GstClockTime start;
+	GstClockTime duration;
+};
+
 struct source_item {
+	struct playback_ctx* ctx;
+	guint64 id;
 	char* uri;
-	GDateTime* created_at;
 
 	GstElement* element;
 	GstElement* ac;
+	GstElement* resample;
+	GstElement* filter;
+
+	gboolean preloaded;
+	gboolean playing;
+
+	/* Running times that PLAY/STOP @<time> asked for, and where in the
+	 * mix this source's next buffer will land; all under schedule_lock */
+	GstClockTime start_at;
+	GstClockTime stop_at;
+	GstClockTime mix_pos;
+
+	/* The source's own timestamp for its next buffer, which is where a
+	 * fade starts from, and the fade itself; also under schedule_lock */
+	GstClockTime stream_pos;
+	struct gain_ramp gain;
+
+	/* Only touched by the streaming thread; set while on_source_buffer
+	 * pushes buffers of its own */
+	gboolean pushing;
+	gint64 convert_started;
+
+	/* Set once a scheduled STOP has taken it out of sources */
+	guint stop_timer;
 };
 
 struct playback_ctx {
@@ -49,9 +96,51 @@ struct playback_ctx {
 	GstElement* pipeline;
 
 	GstElement* mux;
+	GstElement* mix_tee;
 	GstElement* audio_sink;
+	struct output_ctx* outputs;
+
+	/* Audio that made it to the sink, for RENDER; bumped on the
+	 * streaming thread */
+	GMutex* render_lock;
+	GstClockTime rendered;
+	gint64 render_started_at;
+
+	/* Sources that have been started and not yet stopped; the position
+	 * tick only runs while there are any */
+	guint playing;
+	guint position_timer;
+
+	struct slot_table* sources;
+
+	/* Stopped sources parked in READY, most recently used first */
+	GQueue idle_sources;
+	guint pool_max;
+
+	guint64 pool_created;
+	guint64 pool_reused;
+	guint64 pool_recycled;
+	guint64 pool_discarded;
+
+	/* Where the next buffer out of the mixer starts, which is the running
+	 * time it'll play at; bumped on the streaming thread */
+	volatile guint64 mix_position;
+	GMutex* schedule_lock;
+	GList* scheduled_stops;
+
+	/* What the mixer last negotiated, under schedule_lock */
+	GstCaps* mix_caps;
+
+	/* Inside a MULTI batch, sources are linked and unlinked as commands
+	 * come in, but starting and stopping them waits for the commit */
+	gboolean batching;
+	GPtrArray* batch_starts;	/* of batch_start */
+	GPtrArray* batch_stops;		/* of source_item, already out of sources */
+};
 
-	GSList* sources;
+struct batch_start {
+	struct source_item* item;
+	gboolean unblock;
 };
 
 
@@ -62,86 +151,679 @@ static void on_new_source_pad_link(GstElement* src, GstPad* pad, GstElement* mux
 	}
 }
 
-static struct source_item* source_new_and_link(const char* uri, GstElement* pipeline, GstElement* mux)
+static void source_clear_schedule(struct source_item* item)
+{
+	item->start_at = GST_CLOCK_TIME_NONE;
+	item->stop_at = GST_CLOCK_TIME_NONE;
+	item->mix_pos = GST_CLOCK_TIME_NONE;
+	item->stream_pos = 0;
+}
+
+/* Holds the gain at level from here on */
+static void gain_ramp_set(struct gain_ramp* ramp, gdouble level)
+{
+	ramp->from = ramp->to = level;
+	ramp->start = 0;
+	ramp->duration = 0;
+}
+
+static gdouble gain_ramp_at(const struct gain_ramp* ramp, GstClockTime t)
+{
+	if (t <= ramp->start) {
+		return ramp->from;
+	}
+
+	if (t >= ramp->start + ramp->duration) {
+		return ramp->to;
+	}
+
+	return ramp->from + (ramp->to - ramp->from) * (t - ramp->start) / (gdouble)ramp->duration;
+}
+
+/* Whether the ramp is moving at all between start and end */
+static gboolean gain_ramp_is_ramping(const struct gain_ramp* ramp, GstClockTime start, GstClockTime end)
+{
+	return (ramp->from != ramp->to && end > ramp->start && start < ramp->start + ramp->duration);
+}
+
+/* Whether gain_ramp_apply would leave frames starting at start alone */
+static gboolean gain_ramp_is_unity(const struct gain_ramp* ramp, GstClockTime start, guint64 frames, gint rate)
+{
+	GstClockTime end = start + gst_util_uint64_scale(frames, GST_SECOND, rate);
+	return (!gain_ramp_is_ramping(ramp, start, end) && gain_ramp_at(ramp, start) == 1.0);
+}
+
+/* Scales the samples in buffer, which starts at start in the source's own
+ * time, by the ramp. Mid-ramp every frame gets its own gain, so a fade is
+ * a smooth line rather than a step per buffer. Sources are already in the
+ * mix format by now, which is F32 or S16 (see gsu_mix_format_caps). The
+ * buffer has to be writable. */
+static void gain_ramp_apply(const struct gain_ramp* ramp, GstBuffer* buffer, GstClockTime start, guint frame_size, gint rate)
+{
+	GstStructure* s = gst_caps_get_structure(GST_BUFFER_CAPS(buffer), 0);
+	gboolean is_float = gst_structure_has_name(s, "audio/x-raw-float");
+	guint channels = frame_size / (is_float ? sizeof(gfloat) : sizeof(gint16));
+	guint64 frames = GST_BUFFER_SIZE(buffer) / frame_size;
+	GstClockTime end = start + gst_util_uint64_scale(frames, GST_SECOND, rate);
+	gboolean ramping = gain_ramp_is_ramping(ramp, start, end);
+	gdouble gain = gain_ramp_at(ramp, start);
+	guint64 i;
+	guint j;
+
+	if (!ramping && gain == 1.0) {
+		return;
+	}
+
+	for (i = 0; i < frames; i++) {
+		if (ramping) {
+			gain = gain_ramp_at(ramp, start + gst_util_uint64_scale(i, GST_SECOND, rate));
+		}
+
+		if (is_float) {
+			gfloat* samples = (gfloat*)GST_BUFFER_DATA(buffer) + i * channels;
+			for (j = 0; j < channels; j++) {
+				samples[j] *= gain;
+			}
+		} else {
+			gint16* samples = (gint16*)GST_BUFFER_DATA(buffer) + i * channels;
+			for (j = 0; j < channels; j++) {
+				gdouble v = samples[j] * gain;
+				samples[j] = CLAMP(v, G_MININT16, G_MAXINT16);
+			}
+		}
+	}
+}
+
+/* Bytes per frame and frames per second, if the caps are raw audio */
+static gboolean audio_frame_info(GstCaps* caps, guint* frame_size, gint* rate)
+{
+	GstStructure* s;
+	gint channels, width;
+
+	if (!caps || !(s = gst_caps_get_structure(caps, 0)) ||
+	    !gst_structure_get_int(s, "rate", rate) ||
+	    !gst_structure_get_int(s, "channels", &channels) ||
+	    !gst_structure_get_int(s, "width", &width) || *rate <= 0) {
+		return FALSE;
+	}
+
+	*frame_size = channels * width / 8;
+	return (*frame_size > 0);
+}
+
+/* CPU time this thread has used, for timing the conversion; wall time
+ * would also count whatever the scheduler gave to someone else */
+static gint64 thread_cpu_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) {
+		return 0;
+	}
+
+	return (gint64)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+/* A decoded buffer is about to go through audioconvert, audioresample and
+ * the capsfilter, all on this thread and before anything else happens to
+ * it; on_source_buffer sees it come out the other side.
+ *
+ * NB: This runs on the source's streaming thread */
+static gboolean on_convert_buffer(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	struct source_item* item = user_data;
+
+	item->convert_started = thread_cpu_nsec();
+	return TRUE;
+}
+
+/* Most frames of lead-in silence that go out in one buffer */
+#define SILENCE_CHUNK_FRAMES 4096
+
+/* The mixer doesn't look at timestamps, it adds up whatever its inputs
+ * have next; so a source's first buffer plays wherever the mix has got to
+ * when it shows up. A scheduled start pads the front with silence up to
+ * start_at, and a scheduled stop silences everything past stop_at until
+ * the main loop gets around to taking the source out. Both are to the
+ * sample, since we count frames rather than trusting buffer timestamps.
+ * This is also where the source's volume gets applied.
+ *
+ * A probe can't swap the buffer it's given, so when that one is shared
+ * and needs changing, we push a writable copy ourselves and drop it.
+ *
+ * NB: This runs on the source's streaming thread */
+static gboolean on_source_buffer(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	struct source_item* item = user_data;
+	struct playback_ctx* ctx = item->ctx;
+	GstClockTime start, end, stream_start;
+	GstClockTime silence_at = GST_BUFFER_TIMESTAMP(buffer);
+	GstBuffer* out = buffer;
+	GstFlowReturn flow;
+	struct gain_ramp gain;
+	guint64 silence_frames = 0;
+	guint frame_size;
+	guint64 frames, keep;
+	gint rate;
+
+	/* The resampler can hand out more than one buffer per input; only the
+	 * first gets the time */
+	if (item->convert_started) {
+		stats_counter_add(ctx->services->stats, STATS_CONVERT_NSEC, thread_cpu_nsec() - item->convert_started);
+		item->convert_started = 0;
+	}
+
+	if (item->pushing || !audio_frame_info(GST_BUFFER_CAPS(buffer), &frame_size, &rate)) {
+		return TRUE;
+	}
+
+	g_mutex_lock(ctx->schedule_lock);
+
+	if (!GST_CLOCK_TIME_IS_VALID(item->mix_pos)) {
+		item->mix_pos = __sync_fetch_and_add(&ctx->mix_position, 0);
+
+		if (GST_CLOCK_TIME_IS_VALID(item->start_at) && item->start_at > item->mix_pos) {
+			silence_frames = gst_util_uint64_scale_round(item->start_at - item->mix_pos, rate, GST_SECOND);
+			item->mix_pos += gst_util_uint64_scale(silence_frames, GST_SECOND, rate);
+		}
+	}
+
+	start = item->mix_pos;
+	frames = GST_BUFFER_SIZE(buffer) / frame_size;
+	end = start + gst_util_uint64_scale(frames, GST_SECOND, rate);
+	item->mix_pos = end;
+
+	stream_start = (GST_BUFFER_TIMESTAMP_IS_VALID(buffer) ? GST_BUFFER_TIMESTAMP(buffer) : item->stream_pos);
+	item->stream_pos = stream_start + gst_util_uint64_scale(frames, GST_SECOND, rate);
+	gain = item->gain;
+
+	keep = frames;
+	if (GST_CLOCK_TIME_IS_VALID(item->stop_at) && end > item->stop_at) {
+		keep = (item->stop_at > start ? gst_util_uint64_scale_round(item->stop_at - start, rate, GST_SECOND) : 0);
+	}
+
+	g_mutex_unlock(ctx->schedule_lock);
+
+	if ((keep < frames || !gain_ramp_is_unity(&gain, stream_start, frames, rate)) && !gst_buffer_is_writable(buffer)) {
+		out = gst_buffer_make_writable(gst_buffer_ref(buffer));
+	}
+
+	/* Zeroes are silence for every format the mixer takes */
+	if (keep < frames) {
+		memset(GST_BUFFER_DATA(out) + keep * frame_size, 0, (frames - keep) * frame_size);
+	}
+
+	gain_ramp_apply(&gain, out, stream_start, frame_size, rate);
+
+	/* The lead-in goes out a piece at a time, so a start well ahead
+	 * doesn't turn into one huge allocation */
+	item->pushing = TRUE;
+	while (silence_frames > 0) {
+		guint64 chunk = MIN(silence_frames, SILENCE_CHUNK_FRAMES);
+		GstBuffer* silence = gst_buffer_new_and_alloc(chunk * frame_size);
+
+		memset(GST_BUFFER_DATA(silence), 0, GST_BUFFER_SIZE(silence));
+		gst_buffer_set_caps(silence, GST_BUFFER_CAPS(buffer));
+		GST_BUFFER_TIMESTAMP(silence) = silence_at;
+
+		if (GST_CLOCK_TIME_IS_VALID(silence_at)) {
+			silence_at += gst_util_uint64_scale(chunk, GST_SECOND, rate);
+		}
+
+		/* Flushing or unlinked; the real buffer will say so too */
+		if (gst_pad_push(pad, silence) != GST_FLOW_OK) {
+			break;
+		}
+
+		silence_frames -= chunk;
+	}
+
+	if (out == buffer) {
+		item->pushing = FALSE;
+		return TRUE;
+	}
+
+	flow = gst_pad_push(pad, out);
+	item->pushing = FALSE;
+
+	/* If the copy didn't get through, let the original follow it so that
+	 * whatever went wrong gets back upstream; the mixer turns it away the
+	 * same way */
+	return (flow != GST_FLOW_OK);
+}
+
+/* Keeps track of where the mix has got to; see on_source_buffer */
+static gboolean on_mix_buffer(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	struct playback_ctx* ctx = user_data;
+	guint64 old;
+
+	if (!GST_BUFFER_TIMESTAMP_IS_VALID(buffer) || !GST_BUFFER_DURATION_IS_VALID(buffer)) {
+		return TRUE;
+	}
+
+	do {
+		old = ctx->mix_position;
+	} while (!__sync_bool_compare_and_swap(&ctx->mix_position, old, GST_BUFFER_TIMESTAMP(buffer) + GST_BUFFER_DURATION(buffer)));
+
+	return TRUE;
+}
+
+/* Sources come in already in the mix format, so the mixer's caps should
+ * get set once and stay put; count every time they don't.
+ *
+ * NB: This runs on whichever streaming thread got to the mixer first */
+static void on_mix_caps(GObject* pad, GParamSpec* pspec, gpointer user_data)
+{
+	struct playback_ctx* ctx = user_data;
+	GstCaps* caps = NULL;
+
+	g_object_get(pad, "caps", &caps, NULL);
+	if (!caps) {
+		return;
+	}
+
+	g_mutex_lock(ctx->schedule_lock);
+
+	if (!ctx->mix_caps || !gst_caps_is_equal(caps, ctx->mix_caps)) {
+		if (ctx->mix_caps) {
+			stats_counter_add(ctx->services->stats, STATS_MIX_RENEGOTIATIONS, 1);
+			gst_caps_unref(ctx->mix_caps);
+		}
+
+		ctx->mix_caps = gst_caps_ref(caps);
+	}
+
+	g_mutex_unlock(ctx->schedule_lock);
+	gst_caps_unref(caps);
+}
+
+static struct source_item* source_new(struct playback_ctx* ctx, const char* uri)
 {
 	struct source_item* ret = g_new0(struct source_item, 1);
+	GstPad* ac_sink;
+	GstPad* filter_src;
 
+	ret->ctx = ctx;
 	ret->uri = strdup(uri);
-	ret->created_at = g_date_time_new_now_utc();
 	ret->element = gst_element_factory_make("uridecodebin", NULL);
-
 	ret->ac = gst_element_factory_make("audioconvert", NULL);
-	gst_bin_add(GST_BIN(pipeline), ret->ac);
-	gst_element_link(ret->ac, mux);
+	ret->resample = gst_element_factory_make("audioresample", NULL);
+	ret->filter = gst_element_factory_make("capsfilter", NULL);
+
+	if (!ret->element || !ret->ac || !ret->resample || !ret->filter) {
+		g_warning("Couldn't create source elements for %s", uri);
+		if (ret->element) gst_object_unref(ret->element);
+		if (ret->ac) gst_object_unref(ret->ac);
+		if (ret->resample) gst_object_unref(ret->resample);
+		if (ret->filter) gst_object_unref(ret->filter);
+
+		g_free(ret->uri);
+		g_free(ret);
+		return NULL;
+	}
+
+	/* Every source is converted to the mix format on its own thread, so
+	 * the mixer never sees anything else and never has to renegotiate */
+	g_object_set(ret->filter, "caps", ctx->services->mix_caps, NULL);
 
-	gst_bin_add(GST_BIN(pipeline), ret->element);
+	gst_bin_add_many(GST_BIN(ctx->pipeline), ret->element, ret->ac, ret->resample, ret->filter, NULL);
+	gst_element_link_many(ret->ac, ret->resample, ret->filter, NULL);
 	g_object_set(ret->element, "uri", uri, NULL);
 	g_signal_connect(ret->element, "pad-added", G_CALLBACK(on_new_source_pad_link), ret->ac);
 
+	source_clear_schedule(ret);
+	gain_ramp_set(&ret->gain, 1.0);
+
+	ac_sink = gst_element_get_static_pad(ret->ac, "sink");
+	gst_pad_add_buffer_probe(ac_sink, G_CALLBACK(on_convert_buffer), ret);
+	gst_object_unref(ac_sink);
+
+	filter_src = gst_element_get_static_pad(ret->filter, "src");
+	gst_pad_add_buffer_probe(filter_src, G_CALLBACK(on_source_buffer), ret);
+	gst_object_unref(filter_src);
+
+	return ret;
+}
+
+static gboolean source_link(struct source_item* item, GstElement* mux)
+{
+	return gst_element_link(item->filter, mux);
+}
+
+static void source_start(struct source_item* item, GstElement* pipeline)
+{
 	GstState current, pending;
 	gst_element_get_state(pipeline, &current, &pending, 0);
 
-	GstElement* target = ret->element;
+	/* A preloaded source has its state locked so that it sits in PAUSED
+	 * no matter what the pipeline does; hand it back to the pipeline */
+	gst_element_set_locked_state(item->element, FALSE);
+	gst_element_set_locked_state(item->ac, FALSE);
+	gst_element_set_locked_state(item->resample, FALSE);
+	gst_element_set_locked_state(item->filter, FALSE);
+
 	if (pending != GST_STATE_PLAYING && current != GST_STATE_PLAYING) {
-		target = pipeline;
-	} 
+		if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+			g_error("Couldn't move pipeline state to PLAYING");
+		}
+		return;
+	}
 
-	if (gst_element_set_state(target, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+	if (!gst_element_sync_state_with_parent(item->filter) ||
+	    !gst_element_sync_state_with_parent(item->resample) ||
+	    !gst_element_sync_state_with_parent(item->ac) ||
+	    !gst_element_sync_state_with_parent(item->element)) {
 		g_error("Couldn't move element state to PLAYING");
 	}
-
-	return ret;
 }
 
-static void source_free_and_unlink(struct source_item* item, GstElement* pipeline, GstElement* mux)
+static void source_unlink(struct source_item* item, GstElement* mux)
 {
-	if (gst_element_set_state(item->element, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
-		g_error("Couldn't move element state to READY");
-	}
-
 	/* NB: If we simply unlink element, ac, and mux, we'll leave behind a
 	 * request sink on the mux where the source used to be. Since we're 
 	 * playing, this will cause us to fault out and playback to stop.
 	 *
-	 * So here, we grab the mux's request pad via the audioconvert source, 
-	 * then remove it after we do the unlink. */
-	GstPad* ac_src = gst_element_get_static_pad(item->ac, "src");
-	GstPad* mux_sink = gst_pad_get_peer(ac_src);
+	 * So here, we grab the mux's request pad via the capsfilter's source,
+	 * then remove it after we do the unlink. A preloaded source was never
+	 * linked to the mux, so it won't have one. */
+	GstPad* filter_src = gst_element_get_static_pad(item->filter, "src");
+	GstPad* mux_sink = gst_pad_get_peer(filter_src);
+
+	gst_element_set_locked_state(item->element, TRUE);
+	gst_element_set_locked_state(item->ac, TRUE);
+	gst_element_set_locked_state(item->resample, TRUE);
+	gst_element_set_locked_state(item->filter, TRUE);
+
+	if (mux_sink) {
+		gst_pad_unlink(filter_src, mux_sink);
+		gst_element_release_request_pad(mux, mux_sink);
+		gst_object_unref(mux_sink);
+	}
+
+	gst_object_unref(filter_src);
+}
+
+/* Goes from the mixer end back to the decoder. Taking an element down
+ * flushes its pads, which wakes up a streaming thread that's sitting on
+ * the preload block (or pushing into the chain); uridecodebin can only
+ * stop its streaming task once that thread has let go, so it has to go
+ * last or it waits forever. */
+static gboolean source_set_state(struct source_item* item, GstState state)
+{
+	return (gst_element_set_state(item->filter, state) != GST_STATE_CHANGE_FAILURE &&
+		gst_element_set_state(item->resample, state) != GST_STATE_CHANGE_FAILURE &&
+		gst_element_set_state(item->ac, state) != GST_STATE_CHANGE_FAILURE &&
+		gst_element_set_state(item->element, state) != GST_STATE_CHANGE_FAILURE);
+}
 
-	gst_element_unlink_many(item->element, item->ac, mux, NULL);
+static void source_free_and_unlink(struct source_item* item, GstElement* pipeline, GstElement* mux)
+{
+	source_unlink(item, mux);
 
-	gst_element_release_request_pad(mux, mux_sink);
+	if (!source_set_state(item, GST_STATE_NULL)) {
+		g_warning("Couldn't move source for %s to NULL", item->uri);
+	}
 
 	gst_bin_remove(GST_BIN(pipeline), item->element);
 	gst_bin_remove(GST_BIN(pipeline), item->ac);
-		
-	g_date_time_unref(item->created_at);
+	gst_bin_remove(GST_BIN(pipeline), item->resample);
+	gst_bin_remove(GST_BIN(pipeline), item->filter);
+
 	g_free(item->uri);
 	g_free(item);
 }
 
-static guint source_item_to_id(struct source_item* item)
+struct preload_event {
+	struct playback_ctx* ctx;
+	guint64 id;
+};
+
+static gboolean preload_send_event(gpointer user_data)
+{
+	struct preload_event* ev = user_data;
+
+	/* The source may have been stopped (or played) in the meantime */
+	struct source_item* item = slot_table_lookup(ev->ctx->sources, ev->id);
+	if (item && item->preloaded) {
+		char topic[64];
+
+		g_snprintf(topic, sizeof(topic), "player/%" G_GUINT64_FORMAT "/preloaded", ev->id);
+		pubsub_send_printf(ev->ctx->services->pub_sub, topic, "PRELOADED %" G_GUINT64_FORMAT, ev->id);
+	}
+
+	return FALSE;
+}
+
+static void on_preload_blocked(GstPad* pad, gboolean blocked, gpointer user_data)
+{
+	/* NB: This runs on the streaming thread */
+	if (!blocked || !user_data) {
+		return;
+	}
+
+	g_idle_add_full(G_PRIORITY_DEFAULT, preload_send_event, g_memdup(user_data, sizeof(struct preload_event)), g_free);
+}
+
+static void on_preload_unblocked(GstPad* pad, gboolean blocked, gpointer user_data)
+{
+}
+
+static gboolean source_preload(struct source_item* item, struct playback_ctx* ctx)
+{
+	struct preload_event* ev = g_new0(struct preload_event, 1);
+	GstPad* filter_src = gst_element_get_static_pad(item->filter, "src");
+	gboolean ret = FALSE;
+
+	ev->ctx = ctx;
+	ev->id = item->id;
+
+	/* Let the decoder run up to the first buffer that would reach the
+	 * mixer, converted, and hold it there; PLAY then only has to link and
+	 * unblock */
+	item->preloaded = TRUE;
+	if (!gst_pad_set_blocked_async_full(filter_src, TRUE, on_preload_blocked, ev, g_free)) {
+		g_free(ev);
+		goto out;
+	}
+
+	gst_element_set_locked_state(item->element, TRUE);
+	gst_element_set_locked_state(item->ac, TRUE);
+	gst_element_set_locked_state(item->resample, TRUE);
+	gst_element_set_locked_state(item->filter, TRUE);
+
+	if (gst_element_set_state(item->filter, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE ||
+	    gst_element_set_state(item->resample, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE ||
+	    gst_element_set_state(item->ac, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE ||
+	    gst_element_set_state(item->element, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE) {
+		g_warning("Couldn't preroll %s", item->uri);
+		goto out;
+	}
+
+	ret = TRUE;
+
+out:
+	gst_object_unref(filter_src);
+	return ret;
+}
+
+static void source_unblock(struct source_item* item)
+{
+	GstPad* filter_src = gst_element_get_static_pad(item->filter, "src");
+
+	gst_pad_set_blocked_async(filter_src, FALSE, on_preload_unblocked, NULL);
+	gst_object_unref(filter_src);
+}
+
+/* Starts a linked source, or has the batch start it on commit; unblock
+ * lets a preloaded source's held buffer through */
+static void playback_start(struct playback_ctx* ctx, struct source_item* item, gboolean unblock)
+{
+	struct batch_start* start;
+
+	if (!ctx->batching) {
+		source_start(item, ctx->pipeline);
+		if (unblock) source_unblock(item);
+		return;
+	}
+
+	start = g_new0(struct batch_start, 1);
+	start->item = item;
+	start->unblock = unblock;
+	g_ptr_array_add(ctx->batch_starts, start);
+}
+
+static gboolean source_play_preloaded(struct playback_ctx* ctx, struct source_item* item)
+{
+	if (!source_link(item, ctx->mux)) {
+		return FALSE;
+	}
+
+	playback_start(ctx, item, TRUE);
+
+	item->preloaded = FALSE;
+	return TRUE;
+}
+
+static void append_position(guint64 id, gpointer data, gpointer user_data)
+{
+	struct source_item* item = data;
+	GString* out = user_data;
+	GstFormat format = GST_FORMAT_TIME;
+	gint64 position = -1, duration = -1;
+
+	if (!item->playing) {
+		return;
+	}
+
+	/* Asking the audioconvert gets us the position of what's actually
+	 * reached the mixer, rather than what the demuxer has read ahead to */
+	if (!gst_element_query_position(item->ac, &format, &position) || format != GST_FORMAT_TIME) {
+		position = -1;
+	}
+
+	format = GST_FORMAT_TIME;
+	if (!gst_element_query_duration(item->element, &format, &duration) || format != GST_FORMAT_TIME) {
+		duration = -1;
+	}
+
+	g_string_append_printf(out, "%" G_GUINT64_FORMAT " position: %" G_GINT64_FORMAT " duration: %" G_GINT64_FORMAT "\n", id,
+		(position >= 0 ? position / GST_MSECOND : -1), (duration >= 0 ? duration / GST_MSECOND : -1));
+}
+
+/* One message per tick for every playing source, rather than one per
+ * source; times are in milliseconds, -1 if we don't know yet */
+static gboolean playback_position_tick(gpointer user_data)
+{
+	struct playback_ctx* ctx = user_data;
+	GString* msg = g_string_new("POSITIONS\n");
+	gsize len;
+
+	slot_table_foreach(ctx->sources, append_position, msg);
+
+	len = msg->len;
+	pubsub_send_message_take(ctx->services->pub_sub, "player/positions", g_string_free(msg, FALSE), len);
+	return TRUE;
+}
+
+static void playback_set_playing(struct playback_ctx* ctx, struct source_item* item, gboolean playing)
+{
+	if (item->playing == playing) {
+		return;
+	}
+
+	item->playing = playing;
+	ctx->playing += (playing ? 1 : -1);
+
+	if (ctx->services->position_interval <= 0) {
+		return;
+	}
+
+	if (ctx->playing > 0 && !ctx->position_timer) {
+		ctx->position_timer = g_timeout_add(ctx->services->position_interval, playback_position_tick, ctx);
+	} else if (ctx->playing == 0 && ctx->position_timer) {
+		g_source_remove(ctx->position_timer);
+		ctx->position_timer = 0;
+	}
+}
+
+static void on_preload_unblocked(GstPad* pad, gboolean blocked, gpointer user_data);
+
+/* Parks a stopped source in READY so that the next PLAY can skip building
+ * a new uridecodebin. It stays in the pipeline with its state locked, and
+ * uridecodebin drops its decoders and source pads on the way down. */
+static gboolean source_reset(struct source_item* item, GstElement* mux)
 {
-	char to_hash[2048];
-	sprintf(to_hash, "%s 0x%p %lu", item->uri, item, g_date_time_to_unix(item->created_at));
+	source_unlink(item, mux);
+
+	/* A preloaded source's streaming thread is held on the block at the
+	 * capsfilter's source pad; taking the capsfilter down first flushes
+	 * that pad, which lets the held buffer go quietly, where unblocking
+	 * into the unlinked pad would have made the decoder post a not-linked
+	 * error. Then the block can come off, and the rest goes down from the
+	 * mixer end. */
+	if (gst_element_set_state(item->filter, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
+		return FALSE;
+	}
+
+	if (item->preloaded) {
+		source_unblock(item);
+		item->preloaded = FALSE;
+	}
+
+	if (!source_set_state(item, GST_STATE_READY)) {
+		return FALSE;
+	}
 
-	return g_str_hash(to_hash);
+	/* Whoever gets it next starts at full volume */
+	gain_ramp_set(&item->gain, 1.0);
+
+	item->id = 0;
+	return TRUE;
 }
 
-static struct source_item* source_item_from_id(GSList* item_list, guint id)
+static struct source_item* source_acquire(struct playback_ctx* ctx, const char* uri)
 {
-	GSList* haystack = item_list;
+	struct source_item* ret;
+
+	stats_counter_add(ctx->services->stats, STATS_ACTIVE_SOURCES, 1);
 
-	while (haystack) {
-		struct source_item* needle = haystack->data;
-		if (source_item_to_id(needle) == id) {
-			return needle;
+	if (!(ret = g_queue_pop_head(&ctx->idle_sources))) {
+		if ((ret = source_new(ctx, uri))) {
+			ctx->pool_created++;
+		} else {
+			stats_counter_add(ctx->services->stats, STATS_ACTIVE_SOURCES, -1);
 		}
 
-		haystack = g_slist_next(haystack);
+		return ret;
+	}
+
+	g_free(ret->uri);
+	ret->uri = strdup(uri);
+
+	g_object_set(ret->element, "uri", uri, NULL);
+
+	g_mutex_lock(ctx->schedule_lock);
+	source_clear_schedule(ret);
+	g_mutex_unlock(ctx->schedule_lock);
+
+	ctx->pool_reused++;
+	return ret;
+}
+
+static void source_release(struct playback_ctx* ctx, struct source_item* item)
+{
+	stats_counter_add(ctx->services->stats, STATS_ACTIVE_SOURCES, -1);
+	playback_set_playing(ctx, item, FALSE);
+
+	if (g_queue_get_length(&ctx->idle_sources) >= ctx->pool_max || !source_reset(item, ctx->mux)) {
+		source_free_and_unlink(item, ctx->pipeline, ctx->mux);
+		ctx->pool_discarded++;
+		return;
 	}
 
-	return NULL;
+	g_queue_push_head(&ctx->idle_sources, item);
+	ctx->pool_recycled++;
 }
 
 static gboolean playback_bus_callback(GstBus* bus, GstMessage* message, gpointer userdata)
@@ -150,43 +832,126 @@ static gboolean playback_bus_callback(GstBus* bus, GstMessage* message, gpointer
 
 	GError* err = NULL;
 	char* prefix = NULL;
+	char* topic = NULL;
+
+	stats_counter_add(ctx->services->stats, STATS_BUS_MESSAGES, 1);
+	TRACE(TRACE_LEVEL_DEBUG, TRACE_BUS_MESSAGE, GST_MESSAGE_TYPE_NAME(message), GST_MESSAGE_SRC_NAME(message), 0);
 
-	g_warning ("Got pipeline bus message of type %s", GST_MESSAGE_TYPE_NAME(message));
 	switch (GST_MESSAGE_TYPE(message)) {
 	case GST_MESSAGE_ERROR:
 		prefix = "ERROR";
+		topic = "pipeline/error";
 		gst_message_parse_error(message, &err, NULL);
 		break;
 	case GST_MESSAGE_WARNING:
 		prefix = "WARNING";
+		topic = "pipeline/warning";
 		gst_message_parse_warning(message, &err, NULL);
 		break;
 	case GST_MESSAGE_INFO:
 		prefix = "INFO";
+		topic = "pipeline/info";
 		gst_message_parse_info(message, &err, NULL);
 		break;
 	default:
 		return TRUE;
 	}
 
-	char* msg = g_strdup_printf("%s: %s", prefix, err->message);
-	g_warning("Writing message to bus: %s", msg);
-	pubsub_send_message(ctx->services->pub_sub, msg);
+	pubsub_send_printf(ctx->services->pub_sub, topic, "%s: %s", prefix, err->message);
+	g_error_free(err);
+
+	return TRUE;
+}
+
+static gboolean on_sink_buffer(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	struct playback_ctx* ctx = user_data;
+
+	if (!GST_BUFFER_DURATION_IS_VALID(buffer)) {
+		return TRUE;
+	}
+
+	g_mutex_lock(ctx->render_lock);
+	if (!ctx->render_started_at) {
+		ctx->render_started_at = g_get_monotonic_time();
+	}
+
+	ctx->rendered += GST_BUFFER_DURATION(buffer);
+	g_mutex_unlock(ctx->render_lock);
 
 	return TRUE;
 }
 
+/* In render mode the mix goes to a file (or nowhere) as fast as we can
+ * make it, instead of to the sound card in real time */
+static GstElement* playback_sink_new(struct op_services* services)
+{
+	const char* path = services->render_path;
+	GstElement* ret;
+	GstElement* sink;
+	GstElement* enc;
+	GstPad* pad;
+
+	if (!path) {
+#ifdef __APPLE__
+		return gst_element_factory_make("osxaudiosink", NULL);
+#else
+		return gst_element_factory_make("autoaudiosink", NULL);
+#endif
+	}
+
+	if (!*path || !strcmp(path, "null")) {
+		if ((ret = gst_element_factory_make("fakesink", NULL))) {
+			g_object_set(ret, "sync", FALSE, NULL);
+		}
+
+		return ret;
+	}
+
+	enc = gst_element_factory_make("wavenc", NULL);
+	sink = gst_element_factory_make("filesink", NULL);
+	if (!enc || !sink) {
+		if (enc) gst_object_unref(enc);
+		if (sink) gst_object_unref(sink);
+		return NULL;
+	}
+
+	g_object_set(sink, "location", path, "sync", FALSE, NULL);
+
+	ret = gst_bin_new(NULL);
+	gst_bin_add_many(GST_BIN(ret), enc, sink, NULL);
+	gst_element_link(enc, sink);
+
+	pad = gst_element_get_static_pad(enc, "sink");
+	gst_element_add_pad(ret, gst_ghost_pad_new("sink", pad));
+	gst_object_unref(pad);
+
+	return ret;
+}
+
 void* op_playback_new(void* op_services)
 {
-	GError* error = NULL;
 	struct playback_ctx* ret = g_new0(struct playback_ctx, 1);
 
 	ret->services = op_services;
-	if (!(ret->audio_sink = gst_element_factory_make("osxaudiosink", NULL))) {
-		g_error("Couldn't create audio sink: %s", error->message);
+	ret->sources = slot_table_new();
+	ret->pool_max = MAX(ret->services->source_pool_size, 0);
+
+	ret->render_lock = g_mutex_new();
+	ret->schedule_lock = g_mutex_new();
+
+	ret->batch_starts = g_ptr_array_new_with_free_func(g_free);
+	ret->batch_stops = g_ptr_array_new();
+
+	if (!(ret->audio_sink = playback_sink_new(ret->services))) {
+		g_error("Couldn't create audio sink");
 		return NULL;
 	}
 
+	GstPad* sink_pad = gst_element_get_static_pad(ret->audio_sink, "sink");
+	gst_pad_add_buffer_probe(sink_pad, G_CALLBACK(on_sink_buffer), ret);
+	gst_object_unref(sink_pad);
+
 	if (!(ret->mux = gst_element_factory_make("adder", NULL))) {
 		g_error("Couldn't create mixer");
 		return NULL;
@@ -194,14 +959,34 @@ void* op_playback_new(void* op_services)
 
 	ret->pipeline = gst_pipeline_new("pipeline");
 
+	/* The mix goes through a tee so that network outputs can hang off of
+	 * it next to the local sink; see output.c. The capsfilter pins the
+	 * mixer to the mix format, so the first source to show up doesn't get
+	 * to pick one, and the audioconvert after it only ever has to
+	 * negotiate once with the sink. */
+	GstElement* filter = gst_element_factory_make("capsfilter", NULL);
 	GstElement* ac = gst_element_factory_make("audioconvert", NULL);
-	gst_bin_add_many(GST_BIN_CAST(ret->pipeline), ret->mux, ac, ret->audio_sink, NULL);
+	ret->mix_tee = gst_element_factory_make("tee", NULL);
+	g_object_set(filter, "caps", ret->services->mix_caps, NULL);
+	gst_bin_add_many(GST_BIN_CAST(ret->pipeline), ret->mux, filter, ac, ret->mix_tee, NULL);
 
-	if (!(gst_element_link_many(ret->mux, ac, ret->audio_sink, NULL))) {
+	if (!(gst_element_link_many(ret->mux, filter, ac, ret->mix_tee, NULL))) {
 		g_error("Couldn't link mux");
 		return NULL;
 	}
 
+	GstPad* mux_src = gst_element_get_static_pad(ret->mux, "src");
+	gst_pad_add_buffer_probe(mux_src, G_CALLBACK(on_mix_buffer), ret);
+	g_signal_connect(mux_src, "notify::caps", G_CALLBACK(on_mix_caps), ret);
+	gst_object_unref(mux_src);
+
+	if (!(ret->outputs = output_new(ret->pipeline, ret->mix_tee, ret->audio_sink,
+			ret->services->icecast_host, ret->services->icecast_port, ret->services->icecast_password,
+			&ret->services->queue_policy))) {
+		g_error("Couldn't link audio sink");
+		return NULL;
+	}
+
 	GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE(ret->pipeline));
 	gst_bus_add_watch(bus, playback_bus_callback, ret);
 	gst_object_unref(bus);
@@ -219,125 +1004,465 @@ gboolean op_playback_register(void* ctx, struct message_dispatch_entry** entries
 	return TRUE;
 }
 
+static void free_source_in_table(guint64 id, gpointer data, gpointer user_data)
+{
+	struct playback_ctx* context = (struct playback_ctx*)user_data;
+
+	slot_table_remove(context->sources, id);
+	source_free_and_unlink((struct source_item*)data, context->pipeline, context->mux);
+}
+
+/* How long we'll wait at shutdown for a render to finish writing out */
+#define RENDER_EOS_TIMEOUT_SEC 5
+
+/* wavenc only fills in its header's sizes when it sees EOS, so a render
+ * that's just torn down leaves a file most readers won't take. With the
+ * sources gone nothing is feeding the mixer, so we send EOS on from its
+ * output and wait for every sink to get it (the local queue drains on the
+ * way). */
+static void playback_finish_render(struct playback_ctx* ctx)
+{
+	GstBus* bus = gst_pipeline_get_bus(GST_PIPELINE(ctx->pipeline));
+	GstPad* mux_src = gst_element_get_static_pad(ctx->mux, "src");
+	GstMessage* msg;
+	GstState state;
+
+	/* Sinks only post EOS once they're playing */
+	gst_element_get_state(ctx->pipeline, &state, NULL, 0);
+	if (state != GST_STATE_PLAYING || !gst_pad_push_event(mux_src, gst_event_new_eos())) {
+		goto out;
+	}
+
+	msg = gst_bus_timed_pop_filtered(bus, RENDER_EOS_TIMEOUT_SEC * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (!msg) {
+		g_warning("Render didn't finish within %d seconds; %s may be incomplete", RENDER_EOS_TIMEOUT_SEC, ctx->services->render_path);
+	} else if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+		g_warning("Error finishing render to %s", ctx->services->render_path);
+	}
+
+	if (msg) gst_message_unref(msg);
+
+out:
+	gst_object_unref(mux_src);
+	gst_object_unref(bus);
+}
+
 void op_playback_free(void* ctx)
 {
 	struct playback_ctx* context = (struct playback_ctx*)ctx;
-	GSList* iter = context->sources;
 
-	while (iter) {
-		source_free_and_unlink((struct source_item*)iter->data, context->pipeline, context->mux);
-		iter = g_slist_next(iter);
+	struct source_item* item;
+
+	if (context->position_timer) {
+		g_source_remove(context->position_timer);
+	}
+
+	slot_table_foreach(context->sources, free_source_in_table, context);
+
+	for (GList* iter = context->scheduled_stops; iter; iter = iter->next) {
+		item = iter->data;
+
+		g_source_remove(item->stop_timer);
+		source_free_and_unlink(item, context->pipeline, context->mux);
 	}
 
+	g_list_free(context->scheduled_stops);
+
+	while ((item = g_queue_pop_head(&context->idle_sources))) {
+		source_free_and_unlink(item, context->pipeline, context->mux);
+	}
+
+	if (context->services->render_path) {
+		playback_finish_render(context);
+	}
+
+	output_free(context->outputs);
+
 	gst_element_set_state(context->pipeline, GST_STATE_READY);
 	g_object_unref(GST_OBJECT(context->pipeline));
 
-	g_slist_free(context->sources);
+	slot_table_free(context->sources);
+	g_ptr_array_free(context->batch_starts, TRUE);
+	g_ptr_array_free(context->batch_stops, TRUE);
+	g_mutex_free(context->render_lock);
+	g_mutex_free(context->schedule_lock);
+	if (context->mix_caps) gst_caps_unref(context->mix_caps);
 	g_free(context);
 }
 
-static void on_new_pad_tags(GstElement* dec, GstPad* pad, GstElement* fakesink) 
+/* How long after a scheduled stop's running time we take the source out;
+ * by then the mixer is well past it, so all that's left is silence */
+#define SCHEDULED_STOP_GRACE_MS 100
+
+/* How far past the mix a PLAY can be scheduled; anything later is more
+ * likely a bad clock reading than a plan */
+#define PLAY_SCHEDULE_HORIZON (GST_SECOND * 60 * 60)
+
+/* Splits a trailing " @<running-time-ns>" off of param, returning the rest
+ * for the caller to free. Anything else after an @ is left alone, since
+ * it's more likely part of a URI. */
+static char* parse_schedule(const char* param, GstClockTime* at)
 {
-	  GstPad *sinkpad;
+	const char* at_sign = strrchr(param, '@');
+	char* end;
+	guint64 time;
+
+	*at = GST_CLOCK_TIME_NONE;
 
-	  sinkpad = gst_element_get_static_pad(fakesink, "sink"); 
+	if (!at_sign || at_sign == param || at_sign[-1] != ' ' || !g_ascii_isdigit(at_sign[1])) {
+		return g_strdup(param);
+	}
 
-	  if (!gst_pad_is_linked (sinkpad)) {
-		  if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)  {
-			  g_error("Failed to link pads!");
-		  }
-	  }
-	    
-	  gst_object_unref (sinkpad);
+	time = g_ascii_strtoull(at_sign + 1, &end, 10);
+	if (*end) {
+		return g_strdup(param);
+	}
+
+	*at = time;
+	return g_strndup(param, at_sign - 1 - param);
 }
 
-char* op_tags_parse(const char* param, void* ctx)
+static gboolean playback_running_time(struct playback_ctx* ctx, GstClockTime* ret)
 {
-	GstElement* pipe;
-	GstElement* dec;
-	GstElement* sink;
+	GstState state;
+	GstClock* clock;
 
-	GstMessage* msg;
-	char* ret = NULL;
+	gst_element_get_state(ctx->pipeline, &state, NULL, 0);
+	if (state != GST_STATE_PLAYING || !(clock = gst_element_get_clock(ctx->pipeline))) {
+		return FALSE;
+	}
+
+	*ret = gst_clock_get_time(clock) - gst_element_get_base_time(ctx->pipeline);
+	gst_object_unref(clock);
+	return TRUE;
+}
+
+static void playback_schedule_start(struct playback_ctx* ctx, struct source_item* item, GstClockTime at)
+{
+	g_mutex_lock(ctx->schedule_lock);
+	item->start_at = at;
+	g_mutex_unlock(ctx->schedule_lock);
+}
+
+static gboolean on_scheduled_stop(gpointer user_data)
+{
+	struct source_item* item = user_data;
+	struct playback_ctx* ctx = item->ctx;
 
-	pipe = gst_pipeline_new("pipeline");
-	dec = gst_element_factory_make("uridecodebin", NULL); 
+	ctx->scheduled_stops = g_list_remove(ctx->scheduled_stops, item);
+	item->stop_timer = 0;
 
-	g_object_set(dec, "uri", param, NULL);
+	source_release(ctx, item);
+	return FALSE;
+}
+
+/* The item has to be out of sources already; the streaming thread silences
+ * it from at onwards, and it's released once that's safely in the past */
+static void playback_schedule_stop(struct playback_ctx* ctx, struct source_item* item, GstClockTime at)
+{
+	GstClockTime now;
+	guint delay = SCHEDULED_STOP_GRACE_MS;
 
-	gst_bin_add (GST_BIN (pipe), dec);
-	sink = gst_element_factory_make("fakesink", NULL); gst_bin_add (GST_BIN (pipe), sink);
-	g_signal_connect(dec, "pad-added", G_CALLBACK (on_new_pad_tags), sink);
+	g_mutex_lock(ctx->schedule_lock);
+	item->stop_at = at;
+	g_mutex_unlock(ctx->schedule_lock);
 
-	gst_element_set_state(pipe, GST_STATE_PAUSED);
+	if (playback_running_time(ctx, &now) && at > now) {
+		delay += (at - now) / GST_MSECOND;
+	}
 
-	GHashTable* tag_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	item->stop_timer = g_timeout_add(delay, on_scheduled_stop, item);
+	ctx->scheduled_stops = g_list_prepend(ctx->scheduled_stops, item);
+}
 
-	while (TRUE) {
-		GstTagList *tags = NULL;
+/* Ramps a source's volume from wherever it is now (mid-ramp included) to
+ * target over duration, starting with the next buffer it makes */
+static void source_fade(struct playback_ctx* ctx, struct source_item* item, gdouble target, GstClockTime duration)
+{
+	struct gain_ramp* ramp = &item->gain;
+
+	g_mutex_lock(ctx->schedule_lock);
+	ramp->from = gain_ramp_at(ramp, item->stream_pos);
+	ramp->to = target;
+	ramp->start = item->stream_pos;
+	ramp->duration = duration;
+	g_mutex_unlock(ctx->schedule_lock);
+}
 
-		msg = gst_bus_timed_pop_filtered(GST_ELEMENT_BUS (pipe), GST_CLOCK_TIME_NONE,
-			GST_MESSAGE_ASYNC_DONE | GST_MESSAGE_TAG | GST_MESSAGE_ERROR);
+static gboolean parse_fade_args(const char* volume, const char* ms, gdouble* target, GstClockTime* duration)
+{
+	char* end;
+	guint64 msec;
 
-		if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
-			GError* error = NULL;
-			gst_message_parse_error(msg, &error, NULL);
-			ret = g_strdup_printf("FAIL %s", error->message);
-			break;
+	if (volume) {
+		*target = g_ascii_strtod(volume, &end);
+		if (end == volume || *end || *target < 0.0 || *target > 10.0) {
+			return FALSE;
 		}
+	}
 
-		/* error or async_done */ 
-		if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_TAG) {
-			break;
+	msec = g_ascii_strtoull(ms, &end, 10);
+	if (end == ms || *end) {
+		return FALSE;
+	}
+
+	*duration = msec * GST_MSECOND;
+	return TRUE;
+}
+
+void op_playback_batch_begin(void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+
+	context->batching = TRUE;
+}
+
+/* Everything the batch started or stopped happens here, back to back */
+void op_playback_batch_commit(void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+
+	context->batching = FALSE;
+
+	for (guint i = 0; i < context->batch_starts->len; i++) {
+		struct batch_start* start = g_ptr_array_index(context->batch_starts, i);
+
+		source_start(start->item, context->pipeline);
+		if (start->unblock) source_unblock(start->item);
+	}
+
+	for (guint i = 0; i < context->batch_stops->len; i++) {
+		source_release(context, g_ptr_array_index(context->batch_stops, i));
+	}
+
+	g_ptr_array_set_size(context->batch_starts, 0);
+	g_ptr_array_set_size(context->batch_stops, 0);
+}
+
+/* PLAY <uri|preloaded id> [@<running-time-ns>]
+ *
+ * With a time (see CLOCK), the source's first sample enters the mix at
+ * exactly that running time; if it's already gone by, it starts right
+ * away like a plain PLAY. Times more than PLAY_SCHEDULE_HORIZON past
+ * the mix are refused, since the wait is filled with silence */
+char* op_play_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	struct source_item* to_add;
+	GstClockTime start_at;
+	char* target = parse_schedule(param, &start_at);
+	char* ret;
+	guint64 id;
+
+	if (GST_CLOCK_TIME_IS_VALID(start_at) &&
+	    start_at > __sync_fetch_and_add(&context->mix_position, 0) + PLAY_SCHEDULE_HORIZON) {
+		ret = strdup("FAIL Start time is too far ahead");
+		goto out;
+	}
+
+	/* A bare number is a handle from PRELOAD; URIs never look like that */
+	if ((id = slot_table_id_from_string(target))) {
+		if (!(to_add = slot_table_lookup(context->sources, id)) || !to_add->preloaded) {
+			ret = strdup("FAIL id is invalid");
+			goto out;
+		}
+
+		playback_schedule_start(context, to_add, start_at);
+
+		if (!source_play_preloaded(context, to_add)) {
+			ret = g_strdup_printf("FAIL Can't link source: %" G_GUINT64_FORMAT, id);
+			goto out;
 		}
 
-		gst_message_parse_tag(msg, &tags);
-		gsu_tags_to_hash_table(tags, tag_table);
+		playback_set_playing(context, to_add, TRUE);
 
-		gst_tag_list_free(tags);
-		gst_message_unref(msg);
+		ret = g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, id);
+		goto out;
 	}
 
-	if (!ret || g_hash_table_size(tag_table) > 0) {
-		if (ret) g_free(ret);
+	if (!(to_add = source_acquire(context, target))) {
+		ret = g_strdup_printf("FAIL Can't load source: %s", target);
+		goto out;
+	}
+
+	if (!(to_add->id = slot_table_insert(context->sources, to_add))) {
+		source_release(context, to_add);
+		ret = strdup("FAIL Too many sources");
+		goto out;
+	}
 
-		char* table_data = util_hash_table_as_string(tag_table);
-		ret = g_strdup_printf("OK\n%s", table_data);
-		g_free(table_data);
+	if (!source_link(to_add, context->mux)) {
+		slot_table_remove(context->sources, to_add->id);
+		source_release(context, to_add);
+		ret = g_strdup_printf("FAIL Can't link source: %s", target);
+		goto out;
 	}
 
-	g_hash_table_destroy(tag_table);
+	playback_schedule_start(context, to_add, start_at);
+	playback_start(context, to_add, FALSE);
+	playback_set_playing(context, to_add, TRUE);
+
+	ret = g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, to_add->id);
+
+out:
+	g_free(target);
 	return ret;
 }
 
-char* op_play_parse(const char* param, void* ctx)
+char* op_preload_parse(const char* param, void* ctx)
 {
 	struct playback_ctx* context = (struct playback_ctx*)ctx;
-
 	struct source_item* to_add;
-	if (!(to_add = source_new_and_link(param, context->pipeline, context->mux))) {
+
+	if (!(to_add = source_acquire(context, param))) {
 		return g_strdup_printf("FAIL Can't load source: %s", param);
 	}
 
-	context->sources = g_slist_prepend(context->sources, to_add);
-	return g_strdup_printf("OK player id: %u", source_item_to_id(to_add));
+	if (!(to_add->id = slot_table_insert(context->sources, to_add))) {
+		source_release(context, to_add);
+		return strdup("FAIL Too many sources");
+	}
+
+	if (!source_preload(to_add, context)) {
+		slot_table_remove(context->sources, to_add->id);
+		source_release(context, to_add);
+		return g_strdup_printf("FAIL Can't preload source: %s", param);
+	}
+
+	return g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, to_add->id);
 }
 
+/* STOP <id> [@<running-time-ns>]
+ *
+ * With a time, the source goes silent at exactly that running time */
 char* op_stop_parse(const char* param, void* ctx)
 {
 	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	GstClockTime stop_at;
+	char* target = parse_schedule(param, &stop_at);
 
-	guint id = (guint) atoll(param);
-	struct source_item* to_remove = source_item_from_id(context->sources, id);
+	guint64 id = slot_table_id_from_string(target);
+	struct source_item* to_remove = slot_table_remove(context->sources, id);
 
+	g_free(target);
 	if (!to_remove) {
 		return strdup("FAIL id is invalid");
 	}
 
-	context->sources = g_slist_remove(context->sources, to_remove);
+	/* A scheduled stop is already lined up with the rest of the batch */
+	if (GST_CLOCK_TIME_IS_VALID(stop_at)) {
+		playback_schedule_stop(context, to_remove, stop_at);
+		return g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, id);
+	}
+
+	/* It's out of the table, so nothing else in the batch can touch it */
+	if (context->batching) {
+		g_ptr_array_add(context->batch_stops, to_remove);
+		return g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, id);
+	}
+
+	source_release(context, to_remove);
+	return g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, id);
+}
+
+/* Running time is what PLAY and STOP @<time> are scheduled against; the
+ * mix position is how far ahead of that the mixer has got */
+char* op_clock_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	GstClockTime now;
+
+	if (!playback_running_time(context, &now)) {
+		return strdup("FAIL Pipeline isn't running");
+	}
+
+	return g_strdup_printf("OK running-time: %" G_GUINT64_FORMAT " mix-position: %" G_GUINT64_FORMAT,
+		(guint64)now, (guint64)__sync_fetch_and_add(&context->mix_position, 0));
+}
+
+/* FADE <id> <volume> <ms> - volume is linear, 1.0 being unchanged */
+char* op_fade_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	struct source_item* item;
+	GstClockTime duration;
+	gdouble target;
+	char* ret;
+
+	char** args = g_strsplit(param, " ", 3);
+	if (!args[0] || !args[1] || !args[2] || !parse_fade_args(args[1], args[2], &target, &duration)) {
+		ret = strdup("FAIL Usage: FADE <id> <volume> <ms>");
+		goto out;
+	}
+
+	if (!(item = slot_table_lookup(context->sources, slot_table_id_from_string(args[0])))) {
+		ret = strdup("FAIL id is invalid");
+		goto out;
+	}
+
+	source_fade(context, item, target, duration);
+	ret = g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, item->id);
+
+out:
+	g_strfreev(args);
+	return ret;
+}
+
+/* CROSSFADE <from id> <to id> <ms>
+ *
+ * Fades from out and stops it when it gets to silence, while fading to up
+ * to full volume. A preloaded to gets started from silence. */
+char* op_crossfade_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	struct source_item* from;
+	struct source_item* to;
+	GstClockTime duration, stop_at;
+	char* ret;
+
+	char** args = g_strsplit(param, " ", 3);
+	if (!args[0] || !args[1] || !args[2] || !parse_fade_args(NULL, args[2], NULL, &duration)) {
+		ret = strdup("FAIL Usage: CROSSFADE <from id> <to id> <ms>");
+		goto out;
+	}
+
+	from = slot_table_lookup(context->sources, slot_table_id_from_string(args[0]));
+	to = slot_table_lookup(context->sources, slot_table_id_from_string(args[1]));
+	if (!from || !to || from == to || from->preloaded) {
+		ret = strdup("FAIL id is invalid");
+		goto out;
+	}
+
+	if (to->preloaded) {
+		g_mutex_lock(context->schedule_lock);
+		gain_ramp_set(&to->gain, 0.0);
+		g_mutex_unlock(context->schedule_lock);
+
+		if (!source_play_preloaded(context, to)) {
+			ret = g_strdup_printf("FAIL Can't link source: %" G_GUINT64_FORMAT, to->id);
+			goto out;
+		}
+
+		playback_set_playing(context, to, TRUE);
+	}
+
+	source_fade(context, to, 1.0, duration);
+	source_fade(context, from, 0.0, duration);
+
+	/* The fade starts where from's next buffer lands in the mix, so that's
+	 * where it'll be silent from too */
+	g_mutex_lock(context->schedule_lock);
+	stop_at = (GST_CLOCK_TIME_IS_VALID(from->mix_pos) ? from->mix_pos : __sync_fetch_and_add(&context->mix_position, 0));
+	g_mutex_unlock(context->schedule_lock);
+
+	slot_table_remove(context->sources, from->id);
+	playback_schedule_stop(context, from, stop_at + duration);
+
+	ret = g_strdup_printf("OK player id: %" G_GUINT64_FORMAT, to->id);
 
-	source_free_and_unlink(to_remove, context->pipeline, context->mux);
-	return g_strdup_printf("OK player id: %u", id);
+out:
+	g_strfreev(args);
+	return ret;
 }
 
 char* op_dumpgraph_parse(const char* param, void* ctx)
@@ -347,3 +1472,96 @@ char* op_dumpgraph_parse(const char* param, void* ctx)
 	GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(context->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, param);
 	return strdup("OK");
 }
+
+char* op_pool_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	guint64 acquired = context->pool_created + context->pool_reused;
+
+	return g_strdup_printf("OK idle: %u max: %u created: %" G_GUINT64_FORMAT " reused: %" G_GUINT64_FORMAT
+		" recycled: %" G_GUINT64_FORMAT " discarded: %" G_GUINT64_FORMAT " reuse-rate: %.1f%%",
+		g_queue_get_length(&context->idle_sources), context->pool_max,
+		context->pool_created, context->pool_reused, context->pool_recycled, context->pool_discarded,
+		(acquired ? 100.0 * context->pool_reused / acquired : 0.0));
+}
+
+char* op_mount_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	char* error_message = NULL;
+	char* ret = NULL;
+
+	struct output_queue_policy policy;
+
+	/* MOUNT <format> <mount> [policy] */
+	char** args = g_strsplit(param, " ", 3);
+	if (!args[0] || !args[1] || !*args[1]) {
+		ret = g_strdup_printf("FAIL Usage: MOUNT <%s> <mount> [block|drop-oldest|bounded-latency:<ms>]", output_formats());
+		goto out;
+	}
+
+	if (args[2] && !output_queue_policy_parse(args[2], &policy)) {
+		ret = g_strdup_printf("FAIL Unknown queue policy %s", args[2]);
+		goto out;
+	}
+
+	if (!output_mount(context->outputs, args[0], args[1], (args[2] ? &policy : NULL), &error_message)) {
+		ret = g_strdup_printf("FAIL %s", error_message);
+		goto out;
+	}
+
+	ret = g_strdup_printf("OK mounts: %u encoders: %u",
+		output_mount_count(context->outputs), output_encoder_count(context->outputs));
+
+out:
+	g_free(error_message);
+	g_strfreev(args);
+	return ret;
+}
+
+char* op_unmount_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+
+	if (!output_unmount(context->outputs, param)) {
+		return g_strdup_printf("FAIL %s isn't mounted", param);
+	}
+
+	return g_strdup_printf("OK mounts: %u encoders: %u",
+		output_mount_count(context->outputs), output_encoder_count(context->outputs));
+}
+
+char* op_targets_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	char* targets = output_describe_targets(context->outputs);
+	char* ret = g_strdup_printf("OK\n%s", targets);
+
+	g_free(targets);
+	return ret;
+}
+
+char* op_render_parse(const char* param, void* ctx)
+{
+	struct playback_ctx* context = (struct playback_ctx*)ctx;
+	GstClockTime rendered;
+	double wall = 0.0, audio;
+
+	g_mutex_lock(context->render_lock);
+
+	rendered = context->rendered;
+	if (context->render_started_at) {
+		wall = (g_get_monotonic_time() - context->render_started_at) / (double)G_USEC_PER_SEC;
+	}
+
+	if (param && !strcmp(param, "reset")) {
+		context->rendered = 0;
+		context->render_started_at = 0;
+	}
+
+	g_mutex_unlock(context->render_lock);
+
+	audio = (double)rendered / GST_SECOND;
+	return g_strdup_printf("OK mode: %s audio-seconds: %.3f wall-seconds: %.3f realtime: %.2fx",
+		(context->services->render_path ? "render" : "live"), audio, wall, (wall > 0.0 ? audio / wall : 0.0));
+}
@@ -22,11 +22,21 @@
 #define _PLAY_H
 
 void* op_playback_new(void*);
-char* op_tags_parse(const char* param, void*);
 char* op_play_parse(const char* param, void* ctx);
+char* op_preload_parse(const char* param, void* ctx);
 char* op_dumpgraph_parse(const char* param, void* ctx);
 char* op_stop_parse(const char* param, void* ctx);
+char* op_pool_parse(const char* param, void* ctx);
+char* op_mount_parse(const char* param, void* ctx);
+char* op_unmount_parse(const char* param, void* ctx);
+char* op_targets_parse(const char* param, void* ctx);
+char* op_render_parse(const char* param, void* ctx);
+char* op_clock_parse(const char* param, void* ctx);
+char* op_fade_parse(const char* param, void* ctx);
+char* op_crossfade_parse(const char* param, void* ctx);
 gboolean op_playback_register(void* ctx, struct message_dispatch_entry** entries);
 void op_playback_free(void* ctx);
+void op_playback_batch_begin(void* ctx);
+void op_playback_batch_commit(void* ctx);
 
 #endif
@@ -0,0 +1,688 @@
+/*
+   tags.c - Tag extraction message handlers
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parser.h"
+#include "utility.h"
+#include "gst-util.h"
+#include "tag-cache.h"
+#include "op_services.h"
+
+#include "operations/tags.h"
+
+static struct message_dispatch_entry tags_messages[] = {
+	{ "TAGS", NULL, op_tags_parse },
+	{ "TAGCACHE", op_tagcache_parse },
+	{ "SCAN", op_scan_parse },
+	{ NULL },
+};
+
+struct tags_ctx {
+	struct op_services* services;
+	GThreadPool* pool;
+
+	GThreadPool* scan_pool;
+	guint next_scan_id;
+	volatile gint shutting_down;
+
+	/* Walkers push onto scan_pool, so it can't go away until they're
+	 * done; counts queued walks as well as running ones */
+	GMutex* walkers_lock;
+	GCond* walkers_done;
+	guint walkers;
+};
+
+struct tags_job {
+	char* uri;
+	struct tag_cache_key* cache_key;
+	guint flags;		/* gsu_tag_flags */
+	struct parse_reply* reply;
+};
+
+struct tags_scan {
+	struct tags_ctx* ctx;
+	guint id;
+	char** roots;
+
+	volatile gint pending;	/* files in flight, plus one for the walker */
+	volatile gint files;
+	volatile gint failed;
+	gint64 started_at;
+};
+
+struct scan_job {
+	struct tags_scan* scan;
+	char* uri;		/* NULL for the job that walks scan->roots */
+};
+
+struct scan_event {
+	struct tags_ctx* ctx;
+	char* topic;
+	char* message;
+};
+
+/* What we'll pick up when walking a directory; anything named explicitly
+ * gets scanned regardless */
+static const char* scan_extensions[] = {
+	"aac", "aif", "aiff", "alac", "ape", "flac", "m4a", "mp2", "mp3", "mp4",
+	"mpc", "oga", "ogg", "opus", "wav", "wma", "wv", NULL,
+};
+
+/* A URI that hasn't prerolled by then (a stalled stream, say) gives up
+ * with whatever tags it had */
+#define TAGS_EXTRACT_TIMEOUT_SEC 15
+
+/* How often extraction looks up from the bus to see if we're shutting
+ * down, which bounds how long QUIT waits on a running job */
+#define TAGS_EXTRACT_POLL_MSEC 100
+
+static void tags_job_run(gpointer data, gpointer user_data);
+static void scan_job_run(gpointer data, gpointer user_data);
+
+void* op_tags_new(void* op_services)
+{
+	struct tags_ctx* ret = g_new0(struct tags_ctx, 1);
+	GError* err = NULL;
+	int workers;
+
+	ret->services = op_services;
+	ret->walkers_lock = g_mutex_new();
+	ret->walkers_done = g_cond_new();
+
+	if ((workers = ret->services->tag_workers) <= 0) {
+		workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	}
+
+	if (!(ret->pool = g_thread_pool_new(tags_job_run, ret, workers, FALSE, &err))) {
+		g_warning("Couldn't create tag worker pool: %s", err->message);
+		g_error_free(err);
+		g_mutex_free(ret->walkers_lock);
+		g_cond_free(ret->walkers_done);
+		g_free(ret);
+		return NULL;
+	}
+
+	/* Library scans get every core, but in a pool of their own so that a
+	 * big import never queues up in front of an interactive TAGS */
+	workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	if (!(ret->scan_pool = g_thread_pool_new(scan_job_run, ret, workers, FALSE, &err))) {
+		g_warning("Couldn't create scan worker pool: %s", err->message);
+		g_error_free(err);
+		g_thread_pool_free(ret->pool, TRUE, TRUE);
+		g_mutex_free(ret->walkers_lock);
+		g_cond_free(ret->walkers_done);
+		g_free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+gboolean op_tags_register(void* ctx, struct message_dispatch_entry** entries)
+{
+	if (!ctx) {
+		return FALSE;
+	}
+
+	*entries = tags_messages;
+	return TRUE;
+}
+
+void op_tags_free(void* ctx)
+{
+	struct tags_ctx* context = (struct tags_ctx*)ctx;
+
+	/* Running jobs notice this within TAGS_EXTRACT_POLL_MSEC, and queued
+	 * ones fail without extracting anything, so every request still gets
+	 * a reply and waiting for the pools is quick */
+	g_atomic_int_set(&context->shutting_down, TRUE);
+
+	/* Walkers bail at the next directory entry, and whatever they pushed
+	 * before that is in the pool by the time they're done */
+	g_mutex_lock(context->walkers_lock);
+	while (context->walkers > 0) {
+		g_cond_wait(context->walkers_done, context->walkers_lock);
+	}
+	g_mutex_unlock(context->walkers_lock);
+
+	g_thread_pool_free(context->scan_pool, FALSE, TRUE);
+	g_thread_pool_free(context->pool, FALSE, TRUE);
+
+	g_mutex_free(context->walkers_lock);
+	g_cond_free(context->walkers_done);
+	g_free(context);
+}
+
+static void on_new_pad_tags(GstElement* dec, GstPad* pad, GstElement* fakesink) 
+{
+	  GstPad *sinkpad;
+
+	  sinkpad = gst_element_get_static_pad(fakesink, "sink"); 
+
+	  if (!gst_pad_is_linked (sinkpad)) {
+		  if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)  {
+			  g_error("Failed to link pads!");
+		  }
+	  }
+	    
+	  gst_object_unref (sinkpad);
+}
+
+/* Prerolls the URI and collects every tag it posts. If the pipeline errors
+ * out, takes too long or cancel gets set, error_message is set and the
+ * list has whatever we found so far */
+static GstTagList* tags_extract(const char* uri, volatile gint* cancel, char** error_message)
+{
+	GstElement* pipe;
+	GstElement* dec;
+	GstElement* sink;
+
+	GstMessage* msg;
+	GstTagList* ret = gst_tag_list_new();
+	gint64 deadline = g_get_monotonic_time() + TAGS_EXTRACT_TIMEOUT_SEC * G_USEC_PER_SEC;
+
+	/* Whatever's still queued at shutdown ends up here */
+	if (g_atomic_int_get(cancel)) {
+		*error_message = g_strdup("Shutting down");
+		return ret;
+	}
+
+	pipe = gst_pipeline_new("pipeline");
+	dec = gst_element_factory_make("uridecodebin", NULL); 
+
+	g_object_set(dec, "uri", uri, NULL);
+
+	gst_bin_add (GST_BIN (pipe), dec);
+	sink = gst_element_factory_make("fakesink", NULL); gst_bin_add (GST_BIN (pipe), sink);
+	g_signal_connect(dec, "pad-added", G_CALLBACK (on_new_pad_tags), sink);
+
+	gst_element_set_state(pipe, GST_STATE_PAUSED);
+
+	while (TRUE) {
+		GstTagList *tags = NULL;
+
+		if (g_atomic_int_get(cancel)) {
+			*error_message = g_strdup("Shutting down");
+			break;
+		}
+
+		if (g_get_monotonic_time() >= deadline) {
+			*error_message = g_strdup("Timed out reading tags");
+			break;
+		}
+
+		msg = gst_bus_timed_pop_filtered(GST_ELEMENT_BUS (pipe), TAGS_EXTRACT_POLL_MSEC * GST_MSECOND,
+			GST_MESSAGE_ASYNC_DONE | GST_MESSAGE_TAG | GST_MESSAGE_ERROR);
+
+		if (!msg) {
+			continue;
+		}
+
+		if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+			GError* error = NULL;
+			gst_message_parse_error(msg, &error, NULL);
+			*error_message = g_strdup(error->message);
+
+			g_error_free(error);
+			gst_message_unref(msg);
+			break;
+		}
+
+		/* error or async_done */ 
+		if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_TAG) {
+			gst_message_unref(msg);
+			break;
+		}
+
+		/* Later tags win, same as when they went straight into the table */
+		gst_message_parse_tag(msg, &tags);
+		gst_tag_list_insert(ret, tags, GST_TAG_MERGE_REPLACE);
+
+		gst_tag_list_free(tags);
+		gst_message_unref(msg);
+	}
+
+	gst_element_set_state(pipe, GST_STATE_NULL);
+	gst_object_unref(pipe);
+
+	return ret;
+}
+
+/* frames is set if flags asked for binary frames and there were any */
+static char* tags_format_reply(GstTagList* tags, const char* error_message, guint flags, GPtrArray** frames)
+{
+	char* ret;
+
+	*frames = NULL;
+	if (error_message && gst_tag_list_is_empty(tags)) {
+		return g_strdup_printf("FAIL %s", error_message);
+	}
+
+	/* The whole reply is the one frame, straight from the tag list */
+	if (flags & GSU_TAGS_MSGPACK) {
+		GByteArray* packed = gsu_tags_to_msgpack(tags, flags);
+		guint len = packed->len;
+
+		*frames = parse_frames_new();
+		parse_frames_add(*frames, g_byte_array_free(packed, FALSE), len, util_zmq_glib_free, NULL);
+		return g_strdup("OK msgpack");
+	}
+
+	GHashTable* tag_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	GPtrArray* binary = (flags & GSU_TAGS_BINARY ? parse_frames_new() : NULL);
+	gsu_tags_to_hash_table_full(tags, tag_table, flags, binary);
+
+	if (binary && binary->len == 0) {
+		g_ptr_array_free(binary, TRUE);
+		binary = NULL;
+	}
+
+	*frames = binary;
+
+	char* table_data = util_hash_table_as_string(tag_table);
+	ret = g_strdup_printf("OK\n%s", table_data);
+
+	g_free(table_data);
+	g_hash_table_destroy(tag_table);
+	return ret;
+}
+
+/* Runs on one of the pool's threads */
+static void tags_job_run(gpointer data, gpointer user_data)
+{
+	struct tags_job* job = (struct tags_job*)data;
+	struct tags_ctx* context = (struct tags_ctx*)user_data;
+
+	char* error_message = NULL;
+	GstTagList* tags = tags_extract(job->uri, &context->shutting_down, &error_message);
+	GPtrArray* frames;
+	char* message;
+
+	if (job->cache_key && !error_message) {
+		tag_cache_insert(context->services->tag_cache, job->cache_key, tags);
+	}
+
+	message = tags_format_reply(tags, error_message, job->flags, &frames);
+	parse_reply_complete_full(job->reply, message, frames);
+
+	gst_tag_list_free(tags);
+	g_free(error_message);
+	tag_cache_key_free(job->cache_key);
+	g_free(job->uri);
+	g_free(job);
+}
+
+/* Strips leading -flags off param; returns NULL on an unknown one */
+static const char* tags_parse_flags(const char* param, guint* flags)
+{
+	*flags = 0;
+
+	while (*param == '-') {
+		const char* end = strchr(param, ' ');
+		size_t len = (end ? (size_t)(end - param) : strlen(param));
+
+		if (len == strlen("-binary") && !strncmp(param, "-binary", len)) {
+			*flags |= GSU_TAGS_BINARY;
+		} else if (len == strlen("-noimages") && !strncmp(param, "-noimages", len)) {
+			*flags |= GSU_TAGS_NO_IMAGES;
+		} else if (len == strlen("-msgpack") && !strncmp(param, "-msgpack", len)) {
+			*flags |= GSU_TAGS_MSGPACK;
+		} else {
+			return NULL;
+		}
+
+		if (!end) {
+			return NULL;
+		}
+
+		param = end + 1;
+	}
+
+	return param;
+}
+
+/* TAGS [-binary] [-noimages] [-msgpack] <uri>
+ *
+ * -binary sends cover art and other binary tags as extra frames after the
+ * text, with "frame:<n>" as their value; -noimages leaves them out.
+ * -msgpack replies "OK msgpack" followed by a single frame holding the
+ * tags as a MessagePack map (see gsu_tags_to_msgpack). */
+char* op_tags_parse(const char* param, struct parse_reply* reply, void* ctx)
+{
+	struct tags_ctx* context = (struct tags_ctx*)ctx;
+	struct tag_cache* cache = context->services->tag_cache;
+
+	struct tags_job* job;
+	GstTagList* tags;
+	GPtrArray* frames;
+	struct tag_cache_key* key = NULL;
+	guint flags;
+	char* ret;
+
+	if (!(param = tags_parse_flags(param, &flags))) {
+		return g_strdup("FAIL Usage: TAGS [-binary] [-noimages] [-msgpack] <uri>");
+	}
+
+	/* A cache hit is cheap enough to answer right here */
+	if (cache && (key = tag_cache_key_for_uri(param)) && (tags = tag_cache_lookup(cache, key))) {
+		ret = tags_format_reply(tags, NULL, flags, &frames);
+
+		gst_tag_list_free(tags);
+		tag_cache_key_free(key);
+
+		/* Frames can only go out through the deferred path */
+		if (frames) {
+			parse_reply_complete_full(reply, ret, frames);
+			return NULL;
+		}
+
+		return ret;
+	}
+
+	/* Prerolling can take as long as the URI wants it to, so it never
+	 * happens on the main loop */
+	job = g_new0(struct tags_job, 1);
+	job->uri = g_strdup(param);
+	job->cache_key = key;
+	job->flags = flags;
+	job->reply = reply;
+
+	g_thread_pool_push(context->pool, job, NULL);
+	return NULL;
+}
+
+char* op_tagcache_parse(const char* param, void* ctx)
+{
+	struct tags_ctx* context = (struct tags_ctx*)ctx;
+	struct tag_cache_stats stats;
+
+	if (!context->services->tag_cache) {
+		return g_strdup("FAIL Tag cache is disabled");
+	}
+
+	tag_cache_get_stats(context->services->tag_cache, &stats);
+	return g_strdup_printf("OK hits: %" G_GUINT64_FORMAT " disk hits: %" G_GUINT64_FORMAT " misses: %" G_GUINT64_FORMAT " entries: %u disk entries: %u",
+		stats.hits, stats.disk_hits, stats.misses, stats.entries, stats.disk_entries);
+}
+
+static gboolean scan_publish(gpointer user_data)
+{
+	struct scan_event* event = (struct scan_event*)user_data;
+
+	pubsub_send_message_take(event->ctx->services->pub_sub, event->topic, event->message, strlen(event->message));
+
+	g_free(event->topic);
+	g_free(event);
+	return FALSE;
+}
+
+/* Can be called from any thread; takes ownership of topic and message */
+static void scan_post_event(struct tags_ctx* context, char* topic, char* message)
+{
+	struct scan_event* event = g_new0(struct scan_event, 1);
+
+	event->ctx = context;
+	event->topic = topic;
+	event->message = message;
+
+	/* The PUB socket belongs to the main loop */
+	g_idle_add_full(G_PRIORITY_DEFAULT, scan_publish, event, NULL);
+}
+
+static void scan_release(struct tags_scan* scan)
+{
+	if (!g_atomic_int_dec_and_test(&scan->pending)) {
+		return;
+	}
+
+	/* Idles at the same priority run in order, so this lands after the
+	 * last file's event */
+	gint files = g_atomic_int_get(&scan->files);
+	double elapsed = (g_get_monotonic_time() - scan->started_at) / (double)G_USEC_PER_SEC;
+
+	scan_post_event(scan->ctx, g_strdup_printf("scan/%u/done", scan->id), g_strdup_printf("SCANDONE %u files: %d failed: %d elapsed: %.3f files/s: %.1f",
+		scan->id, files, g_atomic_int_get(&scan->failed), elapsed, elapsed > 0 ? files / elapsed : 0.0));
+
+	g_strfreev(scan->roots);
+	g_free(scan);
+}
+
+/* Takes ownership of uri */
+static void scan_push_file(struct tags_scan* scan, char* uri)
+{
+	struct scan_job* job = g_new0(struct scan_job, 1);
+
+	job->scan = scan;
+	job->uri = uri;
+
+	g_atomic_int_inc(&scan->pending);
+	g_thread_pool_push(scan->ctx->scan_pool, job, NULL);
+}
+
+static gboolean scan_wants_file(const char* name)
+{
+	const char* ext = strrchr(name, '.');
+
+	if (!ext) {
+		return FALSE;
+	}
+
+	for (const char** iter = scan_extensions; *iter; iter++) {
+		if (g_ascii_strcasecmp(ext + 1, *iter) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void scan_walk_dir(struct tags_scan* scan, const char* path)
+{
+	const char* name;
+	GDir* dir;
+
+	if (!(dir = g_dir_open(path, 0, NULL))) {
+		g_warning("Couldn't open %s, skipping it", path);
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir)) && !g_atomic_int_get(&scan->ctx->shutting_down)) {
+		if (name[0] == '.') {
+			continue;
+		}
+
+		char* full_path = g_build_filename(path, name, NULL);
+
+		/* NB: Don't follow links to directories, they can make cycles */
+		if (g_file_test(full_path, G_FILE_TEST_IS_DIR)) {
+			if (!g_file_test(full_path, G_FILE_TEST_IS_SYMLINK)) {
+				scan_walk_dir(scan, full_path);
+			}
+		} else if (scan_wants_file(name)) {
+			char* uri = g_filename_to_uri(full_path, NULL, NULL);
+			if (uri) scan_push_file(scan, uri);
+		}
+
+		g_free(full_path);
+	}
+
+	g_dir_close(dir);
+}
+
+static void scan_walk_root(struct tags_scan* scan, const char* root)
+{
+	char* scheme;
+	char* path = NULL;
+	char* uri;
+
+	if (g_atomic_int_get(&scan->ctx->shutting_down)) {
+		return;
+	}
+
+	scheme = g_uri_parse_scheme(root);
+	if (!scheme) {
+		path = g_strdup(root);
+	} else if (strcmp(scheme, "file") == 0) {
+		path = g_filename_from_uri(root, NULL, NULL);
+	}
+
+	/* op_scan_parse already turned away relative paths */
+	if (path && g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		scan_walk_dir(scan, path);
+	} else if (scheme) {
+		scan_push_file(scan, g_strdup(root));
+	} else if ((uri = g_filename_to_uri(path, NULL, NULL))) {
+		scan_push_file(scan, uri);
+	} else {
+		/* A job without a URI is a walker, so this can't go on the pool */
+		g_atomic_int_inc(&scan->failed);
+		g_atomic_int_inc(&scan->files);
+		scan_post_event(scan->ctx, g_strdup_printf("scan/%u/file", scan->id),
+			g_strdup_printf("SCAN %u %s FAIL Can't make a URI out of the path", scan->id, root));
+	}
+
+	g_free(scheme);
+	g_free(path);
+}
+
+static void scan_file(struct tags_scan* scan, const char* uri)
+{
+	struct tag_cache* cache = scan->ctx->services->tag_cache;
+
+	char* error_message = NULL;
+	GstTagList* tags = NULL;
+	struct tag_cache_key* key = NULL;
+
+	if (cache && (key = tag_cache_key_for_uri(uri))) {
+		tags = tag_cache_lookup(cache, key);
+	}
+
+	if (!tags) {
+		tags = tags_extract(uri, &scan->ctx->shutting_down, &error_message);
+
+		if (key && !error_message) {
+			tag_cache_insert(cache, key, tags);
+		}
+	}
+
+	GPtrArray* frames;
+	char* reply = tags_format_reply(tags, error_message, 0, &frames);
+	if (reply[0] == 'F') {
+		g_atomic_int_inc(&scan->failed);
+	}
+
+	g_atomic_int_inc(&scan->files);
+	scan_post_event(scan->ctx, g_strdup_printf("scan/%u/file", scan->id), g_strdup_printf("SCAN %u %s %s", scan->id, uri, reply));
+
+	gst_tag_list_free(tags);
+	g_free(error_message);
+	g_free(reply);
+	tag_cache_key_free(key);
+}
+
+/* Runs on one of the scan pool's threads */
+static void scan_job_run(gpointer data, gpointer user_data)
+{
+	struct scan_job* job = (struct scan_job*)data;
+	struct tags_ctx* context = (struct tags_ctx*)user_data;
+
+	if (job->uri) {
+		scan_file(job->scan, job->uri);
+		scan_release(job->scan);
+	} else {
+		for (char** iter = job->scan->roots; *iter; iter++) {
+			scan_walk_root(job->scan, *iter);
+		}
+
+		scan_release(job->scan);
+
+		g_mutex_lock(context->walkers_lock);
+		if (--context->walkers == 0) {
+			g_cond_broadcast(context->walkers_done);
+		}
+		g_mutex_unlock(context->walkers_lock);
+	}
+
+	g_free(job->uri);
+	g_free(job);
+}
+
+/* SCAN <path or URI>
+ * SCAN "<path or URI>" "<path or URI>" ...
+ *
+ * A bare root is taken whole, since library paths are full of spaces;
+ * several roots go in shell-style quotes, and all of them make up one
+ * scan with one SCANDONE */
+char* op_scan_parse(const char* param, void* ctx)
+{
+	struct tags_ctx* context = (struct tags_ctx*)ctx;
+	struct tags_scan* scan;
+	struct scan_job* job;
+	char** roots = NULL;
+	GError* err = NULL;
+	char* scheme;
+	char* ret;
+
+	if (param[0] == '"' || param[0] == '\'') {
+		if (!g_shell_parse_argv(param, NULL, &roots, &err)) {
+			ret = g_strdup_printf("FAIL Can't parse the list of roots: %s", err->message);
+			g_error_free(err);
+			return ret;
+		}
+	} else if (*param) {
+		roots = g_new0(char*, 2);
+		roots[0] = g_strdup(param);
+	} else {
+		return g_strdup("FAIL Usage: SCAN <path or URI>, or SCAN \"<path or URI>\" ...");
+	}
+
+	for (char** iter = roots; *iter; iter++) {
+		if (!(scheme = g_uri_parse_scheme(*iter)) && !g_path_is_absolute(*iter)) {
+			ret = g_strdup_printf("FAIL Paths to scan must be absolute: %s", *iter);
+			g_strfreev(roots);
+			return ret;
+		}
+
+		g_free(scheme);
+	}
+
+	scan = g_new0(struct tags_scan, 1);
+	scan->ctx = context;
+	scan->id = ++context->next_scan_id;
+	scan->roots = roots;
+	scan->pending = 1;
+	scan->started_at = g_get_monotonic_time();
+
+	/* Walking a big library takes a while too, so even that happens on
+	 * the pool. Results show up on the PUB socket as each file finishes */
+	job = g_new0(struct scan_job, 1);
+	job->scan = scan;
+
+	g_mutex_lock(context->walkers_lock);
+	context->walkers++;
+	g_mutex_unlock(context->walkers_lock);
+
+	g_thread_pool_push(context->scan_pool, job, NULL);
+
+	return g_strdup_printf("OK scan id: %u", scan->id);
+}
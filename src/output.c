@@ -0,0 +1,676 @@
+/*
+   output.c - Network outputs fed from the mixer
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "output.h"
+
+/* The output side of the pipeline looks like this:
+ *
+ *                  +-> queue -> audio sink
+ *                  |
+ * mixer -> mix tee +-> queue -> audioconvert -> encoder -> enc tee +-> queue -> shout2send (/a.mp3)
+ *                  |                                               +-> queue -> shout2send (/b.mp3)
+ *                  |
+ *                  +-> queue -> audioconvert -> encoder -> enc tee +-> queue -> shout2send (/c.ogg)
+ *
+ * so the mix is encoded once per format no matter how many mounts want it,
+ * and each mount gets its own queue so that a slow listener connection
+ * can't stall the encoder for everyone else. A mount that joins a running
+ * encoder gets the stream headers from its caps first (see
+ * on_mount_first_buffer), since an ogg stream is no good without them.
+ *
+ * Every one of those queues is a target with a policy (see
+ * output_queue_policy_parse) and counters that TARGETS reports. The local
+ * sink always blocks, since it's what paces the whole pipeline; if it
+ * leaked, the mixer would run as fast as the decoders could go. */
+
+#define MAX_CHAIN_ELEMENTS 8
+
+struct output_format {
+	const char* name;
+	const char* elements[4];
+};
+
+static const struct output_format formats[] = {
+	{ "mp3", { "lamemp3enc", NULL } },
+	{ "ogg", { "vorbisenc", "oggmux", NULL } },
+	{ NULL },
+};
+
+struct output_queue {
+	char* name;
+	GstElement* queue;
+	struct output_queue_policy policy;
+
+	/* Bumped from the streaming threads */
+	volatile gint in;
+	volatile gint out;
+	volatile gint overruns;
+};
+
+struct encoder_branch {
+	const struct output_format* format;
+	struct output_queue target;
+	GstPad* tee_pad;		/* on the mix tee; NULL until a mount is attached */
+	GstElement* elements[MAX_CHAIN_ELEMENTS];
+	guint n_elements;
+	GstElement* tee;		/* last element of the chain */
+	guint mount_count;
+};
+
+struct mount_target {
+	char* mount;
+	struct output_queue target;
+	struct encoder_branch* branch;
+	GstPad* tee_pad;		/* on branch->tee */
+	GstElement* elements[2];	/* queue, shout2send */
+	gulong header_probe;		/* on the queue's sink; see on_mount_first_buffer */
+};
+
+struct output_ctx {
+	GstElement* pipeline;
+	GstElement* mix_tee;
+
+	char* host;
+	int port;
+	char* password;
+	struct output_queue_policy default_policy;
+
+	struct output_queue local;
+	GstElement* local_sink;
+
+	GHashTable* encoders;		/* format name -> encoder_branch */
+	GHashTable* mounts;		/* mount -> mount_target */
+};
+
+static const struct output_format* output_format_find(const char* name)
+{
+	const struct output_format* iter;
+
+	for (iter = formats; iter->name; iter++) {
+		if (!strcmp(iter->name, name)) {
+			return iter;
+		}
+	}
+
+	return NULL;
+}
+
+const char* output_formats(void)
+{
+	return "mp3 ogg";
+}
+
+gboolean output_queue_policy_parse(const char* str, struct output_queue_policy* policy)
+{
+	const char* bounded = "bounded-latency:";
+	char* end = NULL;
+	guint64 ms;
+
+	if (!strcmp(str, "block")) {
+		policy->mode = OUTPUT_QUEUE_BLOCK;
+		policy->max_latency_ms = 0;
+		return TRUE;
+	}
+
+	if (!strcmp(str, "drop-oldest")) {
+		policy->mode = OUTPUT_QUEUE_DROP_OLDEST;
+		policy->max_latency_ms = 0;
+		return TRUE;
+	}
+
+	if (!strncmp(str, bounded, strlen(bounded))) {
+		ms = g_ascii_strtoull(str + strlen(bounded), &end, 10);
+		if (end == str + strlen(bounded) || *end || ms == 0) {
+			return FALSE;
+		}
+
+		policy->mode = OUTPUT_QUEUE_BOUNDED_LATENCY;
+		policy->max_latency_ms = ms;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+char* output_queue_policy_to_string(const struct output_queue_policy* policy)
+{
+	switch (policy->mode) {
+	case OUTPUT_QUEUE_BLOCK:
+		return g_strdup("block");
+	case OUTPUT_QUEUE_DROP_OLDEST:
+		return g_strdup("drop-oldest");
+	case OUTPUT_QUEUE_BOUNDED_LATENCY:
+		return g_strdup_printf("bounded-latency:%" G_GUINT64_FORMAT, policy->max_latency_ms);
+	}
+
+	return g_strdup("unknown");
+}
+
+static gboolean on_queue_in(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	g_atomic_int_inc(&((struct output_queue*)user_data)->in);
+	return TRUE;
+}
+
+static gboolean on_queue_out(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	g_atomic_int_inc(&((struct output_queue*)user_data)->out);
+	return TRUE;
+}
+
+static void on_queue_overrun(GstElement* queue, gpointer user_data)
+{
+	g_atomic_int_inc(&((struct output_queue*)user_data)->overruns);
+}
+
+/* Creates the queue at the head of a target. Leaky queues drop from the
+ * end that's about to go out, so whatever a receiver gets when it catches
+ * up is the most recent audio */
+static GstElement* output_queue_init(struct output_queue* target, const char* name, const struct output_queue_policy* policy)
+{
+	GstPad* pad;
+
+	target->name = g_strdup(name);
+	target->policy = *policy;
+
+	if (!(target->queue = gst_element_factory_make("queue", NULL))) {
+		return NULL;
+	}
+
+	switch (policy->mode) {
+	case OUTPUT_QUEUE_BLOCK:
+		break;
+	case OUTPUT_QUEUE_DROP_OLDEST:
+		g_object_set(target->queue, "leaky", 2, NULL);
+		break;
+	case OUTPUT_QUEUE_BOUNDED_LATENCY:
+		g_object_set(target->queue,
+			"leaky", 2,
+			"max-size-buffers", 0,
+			"max-size-bytes", 0,
+			"max-size-time", policy->max_latency_ms * GST_MSECOND,
+			NULL);
+		break;
+	}
+
+	pad = gst_element_get_static_pad(target->queue, "sink");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(on_queue_in), target);
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(target->queue, "src");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(on_queue_out), target);
+	gst_object_unref(pad);
+
+	g_signal_connect(target->queue, "overrun", G_CALLBACK(on_queue_overrun), target);
+	return target->queue;
+}
+
+static void output_queue_describe(struct output_queue* target, GString* out)
+{
+	guint level_buffers = 0, max_buffers = 0;
+	guint64 level_time = 0, max_time = 0;
+	gint in, out_count, dropped;
+	double fill = 0.0;
+	char* policy;
+
+	if (!target->queue) {
+		return;
+	}
+
+	g_object_get(target->queue,
+		"current-level-buffers", &level_buffers,
+		"current-level-time", &level_time,
+		"max-size-buffers", &max_buffers,
+		"max-size-time", &max_time,
+		NULL);
+
+	if (max_time) {
+		fill = 100.0 * level_time / max_time;
+	} else if (max_buffers) {
+		fill = 100.0 * level_buffers / max_buffers;
+	}
+
+	/* Whatever went in and neither came out nor is still queued was
+	 * dropped by a leaky queue */
+	in = g_atomic_int_get(&target->in);
+	out_count = g_atomic_int_get(&target->out);
+	dropped = MAX(in - out_count - (gint)level_buffers, 0);
+
+	policy = output_queue_policy_to_string(&target->policy);
+	g_string_append_printf(out, "%s policy: %s level-ms: %" G_GUINT64_FORMAT " level-buffers: %u fill: %.0f%% in: %d out: %d dropped: %d overruns: %d\n",
+		target->name, policy, level_time / GST_MSECOND, level_buffers, fill,
+		in, out_count, dropped, g_atomic_int_get(&target->overruns));
+	g_free(policy);
+}
+
+/* Adds and links elements[0..n), bringing them up to the pipeline's state
+ * from the sink end backwards so nothing pushes into an element that isn't
+ * ready for it yet. The chain is left unattached at the head. */
+static gboolean output_chain_add(GstElement* pipeline, GstElement** elements, guint n)
+{
+	guint i;
+
+	for (i = 0; i < n; i++) {
+		gst_bin_add(GST_BIN(pipeline), elements[i]);
+	}
+
+	for (i = 1; i < n; i++) {
+		if (!gst_element_link(elements[i-1], elements[i])) {
+			g_warning("Couldn't link %s to %s", GST_ELEMENT_NAME(elements[i-1]), GST_ELEMENT_NAME(elements[i]));
+			return FALSE;
+		}
+	}
+
+	for (i = n; i > 0; i--) {
+		if (!gst_element_sync_state_with_parent(elements[i-1])) {
+			g_warning("Couldn't start %s", GST_ELEMENT_NAME(elements[i-1]));
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static GstPad* output_chain_attach(GstElement* tee, GstElement* head)
+{
+	GstPad* ret = gst_element_get_request_pad(tee, "src%d");
+	GstPad* sink = gst_element_get_static_pad(head, "sink");
+
+	if (gst_pad_link(ret, sink) != GST_PAD_LINK_OK) {
+		gst_element_release_request_pad(tee, ret);
+		gst_object_unref(ret);
+		ret = NULL;
+	}
+
+	gst_object_unref(sink);
+	return ret;
+}
+
+/* NB: Unlinking the tee pad first means the chain stops seeing buffers
+ * before we shut it down; the tee takes its own lock on release so this is
+ * safe to do while the pipeline is running. */
+static void output_chain_remove(GstElement* pipeline, GstElement* tee, GstPad* tee_pad, GstElement** elements, guint n)
+{
+	guint i;
+
+	if (tee_pad) {
+		GstPad* peer = gst_pad_get_peer(tee_pad);
+		if (peer) {
+			gst_pad_unlink(tee_pad, peer);
+			gst_object_unref(peer);
+		}
+
+		gst_element_release_request_pad(tee, tee_pad);
+		gst_object_unref(tee_pad);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!elements[i]) {
+			continue;
+		}
+
+		gst_element_set_state(elements[i], GST_STATE_NULL);
+
+		if (GST_ELEMENT_PARENT(elements[i])) {
+			gst_bin_remove(GST_BIN(pipeline), elements[i]);
+		} else {
+			gst_object_unref(elements[i]);
+		}
+	}
+}
+
+static struct encoder_branch* encoder_branch_new(struct output_ctx* ctx, const struct output_format* format)
+{
+	struct encoder_branch* ret = g_new0(struct encoder_branch, 1);
+	struct output_queue_policy policy = { OUTPUT_QUEUE_DROP_OLDEST, 0 };
+	const char* const* name;
+	char* target_name = g_strdup_printf("encoder:%s", format->name);
+
+	ret->format = format;
+	ret->elements[ret->n_elements++] = output_queue_init(&ret->target, target_name, &policy);
+	ret->elements[ret->n_elements++] = gst_element_factory_make("audioconvert", NULL);
+
+	g_free(target_name);
+
+	for (name = format->elements; *name; name++) {
+		ret->elements[ret->n_elements++] = gst_element_factory_make(*name, NULL);
+	}
+
+	ret->tee = ret->elements[ret->n_elements++] = gst_element_factory_make("tee", NULL);
+
+	return ret;
+}
+
+static void encoder_branch_free(struct output_ctx* ctx, struct encoder_branch* branch)
+{
+	output_chain_remove(ctx->pipeline, ctx->mix_tee, branch->tee_pad, branch->elements, branch->n_elements);
+	g_free(branch->target.name);
+	g_free(branch);
+}
+
+static gboolean encoder_branch_start(struct output_ctx* ctx, struct encoder_branch* branch, char** error_message)
+{
+	guint i;
+
+	for (i = 0; i < branch->n_elements; i++) {
+		if (!branch->elements[i]) {
+			*error_message = g_strdup_printf("Can't create the %s encoder, is it installed?", branch->format->name);
+			return FALSE;
+		}
+	}
+
+	if (!output_chain_add(ctx->pipeline, branch->elements, branch->n_elements)) {
+		*error_message = g_strdup_printf("Can't start the %s encoder", branch->format->name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* A mount joining a running encoder picks up the stream wherever it's got
+ * to, but Vorbis can't be decoded without the header packets that went out
+ * at the start. oggmux keeps those on its caps as streamheader, so the
+ * first time anything reaches the mount, we send it those first. Formats
+ * without stream headers, and mounts that were there from the start, get
+ * the buffer as is.
+ *
+ * NB: This runs on the encoder's streaming thread */
+static gboolean on_mount_first_buffer(GstPad* pad, GstBuffer* buffer, gpointer user_data)
+{
+	struct mount_target* target = user_data;
+	GstCaps* caps = GST_BUFFER_CAPS(buffer);
+	const GValue* headers = NULL;
+	guint i;
+
+	gst_pad_remove_buffer_probe(pad, target->header_probe);
+
+	/* Header buffers are flagged; if this is one, the stream is only
+	 * just starting and the rest will follow on their own */
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_IN_CAPS) || !caps || gst_caps_get_size(caps) == 0) {
+		return TRUE;
+	}
+
+	headers = gst_structure_get_value(gst_caps_get_structure(caps, 0), "streamheader");
+	if (!headers || !GST_VALUE_HOLDS_ARRAY(headers)) {
+		return TRUE;
+	}
+
+	for (i = 0; i < gst_value_array_get_size(headers); i++) {
+		const GValue* header = gst_value_array_get_value(headers, i);
+
+		if (!GST_VALUE_HOLDS_BUFFER(header)) {
+			continue;
+		}
+
+		/* Flushing or shutting down; the live buffer will say so too */
+		if (gst_pad_chain(pad, gst_buffer_ref(gst_value_get_buffer(header))) != GST_FLOW_OK) {
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static struct mount_target* mount_target_new(struct output_ctx* ctx, struct encoder_branch* branch, const char* mount, const struct output_queue_policy* policy)
+{
+	struct mount_target* ret = g_new0(struct mount_target, 1);
+
+	ret->mount = g_strdup(mount);
+	ret->branch = branch;
+	ret->elements[0] = output_queue_init(&ret->target, mount, policy);
+	ret->elements[1] = gst_element_factory_make("shout2send", NULL);
+
+	/* NB: This has to be on before the queue is attached to the encoder,
+	 * or the first buffer could get past it */
+	if (ret->elements[0]) {
+		GstPad* sink = gst_element_get_static_pad(ret->elements[0], "sink");
+		ret->header_probe = gst_pad_add_buffer_probe(sink, G_CALLBACK(on_mount_first_buffer), ret);
+		gst_object_unref(sink);
+	}
+
+	if (ret->elements[1]) {
+		/* NB: async=FALSE keeps a new mount from sending a running
+		 * pipeline back through preroll */
+		g_object_set(ret->elements[1],
+			"ip", ctx->host,
+			"port", ctx->port,
+			"password", ctx->password,
+			"mount", mount,
+			"async", FALSE,
+			NULL);
+	}
+
+	return ret;
+}
+
+static void mount_target_free(struct output_ctx* ctx, struct mount_target* target)
+{
+	output_chain_remove(ctx->pipeline, target->branch->tee, target->tee_pad, target->elements, G_N_ELEMENTS(target->elements));
+	g_free(target->target.name);
+	g_free(target->mount);
+	g_free(target);
+}
+
+struct output_ctx* output_new(GstElement* pipeline, GstElement* mix_tee, GstElement* local_sink,
+	const char* host, int port, const char* password, const struct output_queue_policy* default_policy)
+{
+	struct output_ctx* ret = g_new0(struct output_ctx, 1);
+	struct output_queue_policy block = { OUTPUT_QUEUE_BLOCK, 0 };
+	GstElement* local[2];
+
+	ret->pipeline = pipeline;
+	ret->mix_tee = mix_tee;
+	ret->host = g_strdup(host);
+	ret->port = port;
+	ret->password = g_strdup(password);
+	ret->default_policy = *default_policy;
+
+	ret->encoders = g_hash_table_new(g_str_hash, g_str_equal);
+	ret->mounts = g_hash_table_new(g_str_hash, g_str_equal);
+
+	local[0] = output_queue_init(&ret->local, "local", &block);
+	local[1] = ret->local_sink = local_sink;
+
+	if (!local[0] || !output_chain_add(pipeline, local, G_N_ELEMENTS(local)) ||
+	    !gst_element_link(mix_tee, local[0])) {
+		g_warning("Couldn't attach the local sink to the mixer");
+		output_free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+void output_free(struct output_ctx* ctx)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!ctx) {
+		return;
+	}
+
+	/* Detach the encoders first so that nothing is pushing into the
+	 * mounts while we take them down */
+	g_hash_table_iter_init(&iter, ctx->encoders);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct encoder_branch* branch = value;
+		GstPad* tee_pad = branch->tee_pad;
+
+		branch->tee_pad = NULL;
+		output_chain_remove(ctx->pipeline, ctx->mix_tee, tee_pad, NULL, 0);
+	}
+
+	g_hash_table_iter_init(&iter, ctx->mounts);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		mount_target_free(ctx, value);
+	}
+
+	g_hash_table_iter_init(&iter, ctx->encoders);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		encoder_branch_free(ctx, value);
+	}
+
+	if (ctx->local.queue) {
+		GstPad* sink = gst_element_get_static_pad(ctx->local.queue, "sink");
+		GstPad* tee_pad = gst_pad_get_peer(sink);
+		GstElement* local[2] = { ctx->local.queue, ctx->local_sink };
+
+		output_chain_remove(ctx->pipeline, ctx->mix_tee, tee_pad, local, G_N_ELEMENTS(local));
+		gst_object_unref(sink);
+	}
+
+	g_free(ctx->local.name);
+	g_hash_table_destroy(ctx->mounts);
+	g_hash_table_destroy(ctx->encoders);
+	g_free(ctx->host);
+	g_free(ctx->password);
+	g_free(ctx);
+}
+
+gboolean output_mount(struct output_ctx* ctx, const char* format_name, const char* mount,
+	const struct output_queue_policy* policy, char** error_message)
+{
+	const struct output_format* format;
+	struct encoder_branch* branch = NULL;
+	struct mount_target* target = NULL;
+	gboolean new_branch = FALSE;
+
+	if (!(format = output_format_find(format_name))) {
+		*error_message = g_strdup_printf("Unknown format %s, try one of: %s", format_name, output_formats());
+		return FALSE;
+	}
+
+	if (g_hash_table_lookup(ctx->mounts, mount)) {
+		*error_message = g_strdup_printf("%s is already mounted", mount);
+		return FALSE;
+	}
+
+	if (!(branch = g_hash_table_lookup(ctx->encoders, format->name))) {
+		branch = encoder_branch_new(ctx, format);
+		new_branch = TRUE;
+
+		if (!encoder_branch_start(ctx, branch, error_message)) {
+			goto fail;
+		}
+	}
+
+	target = mount_target_new(ctx, branch, mount, (policy ? policy : &ctx->default_policy));
+	if (!target->elements[0] || !target->elements[1]) {
+		*error_message = g_strdup("Can't create shout2send, is gst-plugins-good installed?");
+		goto fail;
+	}
+
+	/* NB: shout2send doesn't connect to the server until the first buffer
+	 * gets to it, so a bad host or password won't fail MOUNT; it turns up
+	 * afterwards as an error on pipeline/error */
+	if (!output_chain_add(ctx->pipeline, target->elements, G_N_ELEMENTS(target->elements)) ||
+	    !(target->tee_pad = output_chain_attach(branch->tee, target->elements[0]))) {
+		*error_message = g_strdup_printf("Can't start %s for %s:%d", mount, ctx->host, ctx->port);
+		goto fail;
+	}
+
+	/* Only feed the encoder once something is listening to it; a tee with
+	 * no src pads would fail the whole branch with not-linked */
+	if (!branch->tee_pad && !(branch->tee_pad = output_chain_attach(ctx->mix_tee, branch->elements[0]))) {
+		*error_message = g_strdup_printf("Can't attach the %s encoder to the mixer", format->name);
+		goto fail;
+	}
+
+	branch->mount_count++;
+	g_hash_table_insert(ctx->encoders, (gpointer)format->name, branch);
+	g_hash_table_insert(ctx->mounts, target->mount, target);
+	return TRUE;
+
+fail:
+	if (target) {
+		mount_target_free(ctx, target);
+	}
+
+	if (new_branch) {
+		encoder_branch_free(ctx, branch);
+	}
+
+	return FALSE;
+}
+
+gboolean output_unmount(struct output_ctx* ctx, const char* mount)
+{
+	struct mount_target* target;
+	struct encoder_branch* branch;
+
+	if (!(target = g_hash_table_lookup(ctx->mounts, mount))) {
+		return FALSE;
+	}
+
+	g_hash_table_remove(ctx->mounts, mount);
+	branch = target->branch;
+
+	/* Take the encoder off the mixer before its last mount goes away,
+	 * for the same reason we attach it last */
+	if (--branch->mount_count == 0) {
+		g_hash_table_remove(ctx->encoders, branch->format->name);
+
+		output_chain_remove(ctx->pipeline, ctx->mix_tee, branch->tee_pad, NULL, 0);
+		branch->tee_pad = NULL;
+
+		mount_target_free(ctx, target);
+		encoder_branch_free(ctx, branch);
+		return TRUE;
+	}
+
+	mount_target_free(ctx, target);
+	return TRUE;
+}
+
+guint output_encoder_count(struct output_ctx* ctx)
+{
+	return g_hash_table_size(ctx->encoders);
+}
+
+guint output_mount_count(struct output_ctx* ctx)
+{
+	return g_hash_table_size(ctx->mounts);
+}
+
+char* output_describe_targets(struct output_ctx* ctx)
+{
+	GString* ret = g_string_new("");
+	GHashTableIter iter;
+	gpointer value;
+
+	output_queue_describe(&ctx->local, ret);
+
+	g_hash_table_iter_init(&iter, ctx->encoders);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		output_queue_describe(&((struct encoder_branch*)value)->target, ret);
+	}
+
+	g_hash_table_iter_init(&iter, ctx->mounts);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		output_queue_describe(&((struct mount_target*)value)->target, ret);
+	}
+
+	return g_string_free(ret, FALSE);
+}
@@ -0,0 +1,66 @@
+/*
+   output.h - Network outputs fed from the mixer
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+struct output_ctx;
+
+enum output_queue_mode {
+	OUTPUT_QUEUE_BLOCK,
+	OUTPUT_QUEUE_DROP_OLDEST,
+	OUTPUT_QUEUE_BOUNDED_LATENCY,
+};
+
+/* What a target's queue does when its receiver falls behind */
+struct output_queue_policy {
+	enum output_queue_mode mode;
+	guint64 max_latency_ms;		/* OUTPUT_QUEUE_BOUNDED_LATENCY only */
+};
+
+/* Accepts "block", "drop-oldest" or "bounded-latency:<ms>" */
+gboolean output_queue_policy_parse(const char* str, struct output_queue_policy* policy);
+char* output_queue_policy_to_string(const struct output_queue_policy* policy);
+
+/* mix_tee is a tee in pipeline that carries the raw mix; local_sink gets
+ * attached to it right away, and every format gets a single encoder
+ * hanging off of it, shared by all mounts in that format; a mount that
+ * joins partway gets the format's stream headers first */
+struct output_ctx* output_new(GstElement* pipeline, GstElement* mix_tee, GstElement* local_sink,
+	const char* host, int port, const char* password, const struct output_queue_policy* default_policy);
+void output_free(struct output_ctx* ctx);
+
+/* format is one of the names in output_formats(), e.g. "mp3" or "ogg";
+ * policy may be NULL to use the default */
+gboolean output_mount(struct output_ctx* ctx, const char* format, const char* mount,
+	const struct output_queue_policy* policy, char** error_message);
+gboolean output_unmount(struct output_ctx* ctx, const char* mount);
+
+/* One line per target with its policy, fill level and drop counters */
+char* output_describe_targets(struct output_ctx* ctx);
+
+const char* output_formats(void);
+guint output_encoder_count(struct output_ctx* ctx);
+guint output_mount_count(struct output_ctx* ctx);
+
+#endif
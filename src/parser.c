@@ -22,24 +22,56 @@
 #include <string.h>
 
 #include "parser.h"
+#include "stats.h"
+#include "trace.h"
 
 struct reg_entry_with_ctx {
-	const char* prefix;
+	char* prefix;
 	void* plugin_context;
 
 	parse_handler_cb parser;
+	parse_async_handler_cb async_parser;
+	struct stats_verb* stats;
 };
 
 struct plugin_entry_with_ctx {
 	void *ctx;
 	void (*plugin_free)(void* ctx);
+	void (*plugin_batch_begin)(void* ctx);
+	void (*plugin_batch_commit)(void* ctx);
+};
+
+struct batch_command {
+	struct reg_entry_with_ctx* entry;
+	const char* param;
 };
 
 struct parse_ctx {
-	GHashTable* message_table; 	/* prefix -> reg_entry_with_ctx */
+	GArray* message_table; 		/* reg_entry_with_ctx, sorted by prefix */
 	GSList* plugin_list; 		/* list of plugin_entry_with_ctx */
+
+	parse_reply_func reply_func;
+	void* reply_user_data;
+
+	struct stats_ctx* stats;
+	struct stats_verb* multi_stats;
+};
+
+struct parse_reply {
+	struct parse_ctx* parser;
+	void* envelope;
+	char* message;
+	GPtrArray* frames;
+
+	struct stats_verb* stats;
+	gint64 started_at;
 };
 
+static inline gboolean parse_reply_failed(const char* message)
+{
+	return (!message || !strncmp(message, "FAIL", 4));
+}
+
 static void plugin_entry_free(void* entry);
 
 struct parse_ctx* parse_new(void)
@@ -47,27 +79,69 @@ struct parse_ctx* parse_new(void)
 	struct parse_ctx* ret = g_new0(struct parse_ctx, 1);
 
 	ret->plugin_list = NULL;
-	ret->message_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ret->message_table = g_array_new(FALSE, TRUE, sizeof(struct reg_entry_with_ctx));
 
 	return ret;
 }
 
 void parse_free(struct parse_ctx* parser)
 {
-	g_hash_table_destroy(parser->message_table);
+	for (guint i = 0; i < parser->message_table->len; i++) {
+		g_free(g_array_index(parser->message_table, struct reg_entry_with_ctx, i).prefix);
+	}
+
+	g_array_free(parser->message_table, TRUE);
 	g_slist_free_full(parser->plugin_list, plugin_entry_free);
 
 	g_free(parser);
 }
 
+/* Compares a verb that isn't NUL-terminated against a registered prefix */
+static int prefix_compare(const char* verb, size_t verb_len, const char* prefix)
+{
+	int ret = strncmp(verb, prefix, verb_len);
+
+	if (ret == 0 && prefix[verb_len] != '\0') {
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Binary search over the sorted message table. Returns the index of the
+ * match, or the index the verb would be inserted at if found is FALSE */
+static guint message_table_search(struct parse_ctx* parser, const char* verb, size_t verb_len, gboolean* found)
+{
+	guint lo = 0, hi = parser->message_table->len;
+
+	*found = FALSE;
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		struct reg_entry_with_ctx* entry = &g_array_index(parser->message_table, struct reg_entry_with_ctx, mid);
+		int cmp = prefix_compare(verb, verb_len, entry->prefix);
+
+		if (cmp == 0) {
+			*found = TRUE;
+			return mid;
+		}
+
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return lo;
+}
+
 gboolean parse_register_plugin(struct parse_ctx* parser, struct parser_plugin_entry* plugin)
 {
 	void* plugin_ctx = (*plugin->plugin_new)(plugin->context);
 
 	struct message_dispatch_entry* regd_messages = NULL;
 	struct plugin_entry_with_ctx* p_entry;
-	struct reg_entry_with_ctx* r_entry;
-	char* prefix;
+	struct reg_entry_with_ctx r_entry;
 
 	if (!(*plugin->plugin_register)(plugin_ctx, &regd_messages)) {
 		g_warning("plugin failed to register: %s", plugin->friendly_name);
@@ -79,61 +153,317 @@ gboolean parse_register_plugin(struct parse_ctx* parser, struct parser_plugin_en
 	p_entry = g_new0(struct plugin_entry_with_ctx, 1);
 	p_entry->ctx = plugin_ctx;
 	p_entry->plugin_free = plugin->plugin_free;
+	p_entry->plugin_batch_begin = plugin->plugin_batch_begin;
+	p_entry->plugin_batch_commit = plugin->plugin_batch_commit;
 	parser->plugin_list = g_slist_prepend(parser->plugin_list, p_entry);
 
 	for (struct message_dispatch_entry* msg = regd_messages; msg->prefix; msg++) {
-		r_entry = g_new0(struct reg_entry_with_ctx, 1);
-		prefix = strdup(msg->prefix);
+		gboolean found;
+		guint idx = message_table_search(parser, msg->prefix, strlen(msg->prefix), &found);
+
+		r_entry.prefix = g_strdup(msg->prefix);
+		r_entry.plugin_context = plugin_ctx;
+		r_entry.parser = msg->op_parse;
+		r_entry.async_parser = msg->op_parse_async;
+		r_entry.stats = stats_register_verb(parser->stats, msg->prefix);
+
+		/* Last one to register a prefix wins */
+		if (found) {
+			struct reg_entry_with_ctx* existing = &g_array_index(parser->message_table, struct reg_entry_with_ctx, idx);
+			g_free(existing->prefix);
+			*existing = r_entry;
+		} else {
+			g_array_insert_vals(parser->message_table, idx, &r_entry, 1);
+		}
+	}
 
-		r_entry->prefix = prefix;
-		r_entry->plugin_context = plugin_ctx;
-		r_entry->parser = msg->op_parse;
+	g_print("Registered plugin: %s\n", plugin->friendly_name);
+	return TRUE;
+}
+
+void parse_set_reply_func(struct parse_ctx* parser, parse_reply_func func, void* user_data)
+{
+	parser->reply_func = func;
+	parser->reply_user_data = user_data;
+}
+
+void parse_set_stats(struct parse_ctx* parser, struct stats_ctx* stats)
+{
+	parser->stats = stats;
+	parser->multi_stats = stats_register_verb(stats, "MULTI");
+}
+
+/* Splits a message into its verb and parameter without copying, accepting
+ * exactly what "^([A-Z]+)[ ]?(.+)$" used to. The verb is *not* terminated,
+ * the parameter is (a trailing newline is overwritten in place). */
+static gboolean parse_tokenize(char* message, const char** verb, size_t* verb_len, const char** param)
+{
+	size_t len = 0;
+	char* end;
+	char* p;
 
-		g_hash_table_insert(parser->message_table, prefix, r_entry);
+	while (message[len] >= 'A' && message[len] <= 'Z') {
+		len++;
 	}
 
-	g_print("Registered plugin: %s\n", plugin->friendly_name);
+	if (len == 0) {
+		return FALSE;
+	}
+
+	/* '$' also matches right before a final newline, and '.' never
+	 * matches a newline, so that's the only one we'll put up with */
+	end = message + len + strlen(message + len);
+	if (end[-1] == '\n') {
+		*--end = '\0';
+	}
+
+	p = message + len;
+	if (memchr(p, '\n', end - p)) {
+		return FALSE;
+	}
+
+	if (*p == ' ' && p[1] != '\0') {
+		p++;
+	} else if (*p == '\0') {
+		/* Nothing after the verb - the regex would backtrack and hand the
+		 * verb's last letter to the parameter, i.e. "PING" => "PIN", "G" */
+		if (len < 2) {
+			return FALSE;
+		}
+
+		len--;
+		p--;
+	}
+
+	*verb = message;
+	*verb_len = len;
+	*param = p;
 	return TRUE;
 }
 
-char* parse_message(struct parse_ctx* parser, const char* message)
+static void parse_batch_notify(struct parse_ctx* parser, gboolean commit)
+{
+	for (GSList* iter = parser->plugin_list; iter; iter = iter->next) {
+		struct plugin_entry_with_ctx* p = iter->data;
+		void (*func)(void*) = (commit ? p->plugin_batch_commit : p->plugin_batch_begin);
+
+		if (func) (*func)(p->ctx);
+	}
+}
+
+/* Appends a command's reply as one logical line */
+static void parse_batch_append(GString* out, const char* reply)
+{
+	size_t len = strlen(reply);
+
+	/* A trailing newline would look like the start of an empty reply */
+	if (len > 0 && reply[len - 1] == '\n') {
+		len--;
+	}
+
+	g_string_append_c(out, '\n');
+
+	for (size_t i = 0; i < len; i++) {
+		g_string_append_c(out, reply[i]);
+		if (reply[i] == '\n') g_string_append_c(out, ' ');
+	}
+}
+
+static char* parse_batch(struct parse_ctx* parser, char* commands)
 {
-	char* ret = strdup("FAIL Message is Invalid");
+	GArray* batch = g_array_new(FALSE, FALSE, sizeof(struct batch_command));
+	GString* ret = NULL;
+	GString* replies;
+	char* line = commands;
+	guint line_no = 0;
+	guint failed = 0;
+
+	/* Check every command before running any of them */
+	while (line && *line) {
+		struct batch_command cmd;
+		const char* verb;
+		size_t verb_len;
+		gboolean found;
+		guint idx;
+		char* next = strchr(line, '\n');
+
+		if (next) *next++ = '\0';
+		line_no++;
+
+		if (!*line) {
+			line = next;
+			continue;
+		}
+
+		if (!parse_tokenize(line, &verb, &verb_len, &cmd.param)) {
+			ret = g_string_new(NULL);
+			g_string_printf(ret, "FAIL Command %u is invalid", line_no);
+			goto out;
+		}
+
+		idx = message_table_search(parser, verb, verb_len, &found);
+		if (!found) {
+			ret = g_string_new(NULL);
+			g_string_printf(ret, "FAIL Command %u is invalid", line_no);
+			goto out;
+		}
+
+		cmd.entry = &g_array_index(parser->message_table, struct reg_entry_with_ctx, idx);
+		if (!cmd.entry->parser) {
+			ret = g_string_new(NULL);
+			g_string_printf(ret, "FAIL Command %u can't be batched: %s", line_no, cmd.entry->prefix);
+			goto out;
+		}
+
+		g_array_append_val(batch, cmd);
+		line = next;
+	}
+
+	/* NB: Checking covers syntax and verbs only. Once the batch starts, a
+	 * command that fails (STOP of an unknown id, say) doesn't undo the
+	 * ones before it, so the header counts failures for the client */
+	replies = g_string_new(NULL);
+	parse_batch_notify(parser, FALSE);
+
+	for (guint i = 0; i < batch->len; i++) {
+		struct batch_command* cmd = &g_array_index(batch, struct batch_command, i);
+		gint64 started_at = g_get_monotonic_time();
+		char* reply = (*cmd->entry->parser)(cmd->param, cmd->entry->plugin_context);
+
+		stats_verb_record(parser->stats, cmd->entry->stats, g_get_monotonic_time() - started_at, parse_reply_failed(reply));
+
+		if (parse_reply_failed(reply)) failed++;
+
+		parse_batch_append(replies, reply ? reply : "FAIL No reply");
+		g_free(reply);
+	}
 
-	GError* err = NULL;
-	GRegex* msg_regex = g_regex_new("^([A-Z]+)[ ]?(.+)$", 0, 0, &err);
-	char* prefix = NULL;
-	char* param;
+	parse_batch_notify(parser, TRUE);
+
+	ret = g_string_new(NULL);
+	g_string_printf(ret, "OK %u failed: %u", batch->len, failed);
+	g_string_append_len(ret, replies->str, replies->len);
+	g_string_free(replies, TRUE);
+
+out:
+	g_array_free(batch, TRUE);
+	return g_string_free(ret, FALSE);
+}
+
+char* parse_message(struct parse_ctx* parser, char* message, void* envelope)
+{
+	const char* verb;
+	const char* param;
+	size_t verb_len;
+	gboolean found;
+	guint idx;
 	struct reg_entry_with_ctx* prefix_entry;
+	struct parse_reply* reply;
+	gint64 started_at = g_get_monotonic_time();
+	char* ret;
+
+	/* NB: Batches have to be picked off before tokenizing, which won't
+	 * have newlines in a message */
+	if (!strncmp(message, "MULTI\n", strlen("MULTI\n"))) {
+		ret = parse_batch(parser, message + strlen("MULTI\n"));
+		stats_verb_record(parser->stats, parser->multi_stats, g_get_monotonic_time() - started_at, parse_reply_failed(ret));
+		return ret;
+	}
 
-	GMatchInfo* match_info = NULL;
-	if (!g_regex_match(msg_regex, message, 0, &match_info)) {
-		g_warning("Message is invalid: %s", message);
-		goto out;
+	if (!parse_tokenize(message, &verb, &verb_len, &param)) {
+		TRACE(TRACE_LEVEL_WARNING, TRACE_INVALID_REQUEST, NULL, message, strlen(message));
+		goto fail;
 	}
 
-	prefix = g_match_info_fetch(match_info, 1);
-	if (!prefix) {
-		goto out;
+	idx = message_table_search(parser, verb, verb_len, &found);
+	if (!found) {
+		TRACE(TRACE_LEVEL_WARNING, TRACE_INVALID_REQUEST, NULL, message, strlen(message));
+		goto fail;
 	}
 
-	prefix_entry = g_hash_table_lookup(parser->message_table, prefix);
-	if (!prefix_entry) {
-		g_warning("Message is invalid: %s", message);
+	prefix_entry = &g_array_index(parser->message_table, struct reg_entry_with_ctx, idx);
+	if (prefix_entry->parser) {
+		ret = (*prefix_entry->parser)(param, prefix_entry->plugin_context);
 		goto out;
 	}
 
-	param = g_match_info_fetch(match_info, 2);
-	g_free(ret); /* free the error message */
-	ret = (*prefix_entry->parser)(param, prefix_entry->plugin_context);
-	g_free(param);
+	reply = g_new0(struct parse_reply, 1);
+	reply->parser = parser;
+	reply->envelope = envelope;
+	reply->stats = prefix_entry->stats;
+	reply->started_at = started_at;
 
-out:
-	if (prefix) g_free(prefix);
-	if (match_info) g_match_info_free(match_info);
-	g_regex_unref(msg_regex);
+	/* A deferred request gets timed when it's completed */
+	if (!(ret = (*prefix_entry->async_parser)(param, reply, prefix_entry->plugin_context))) {
+		return NULL;
+	}
 
+	g_free(reply);
+
+out:
+	stats_verb_record(parser->stats, prefix_entry->stats, g_get_monotonic_time() - started_at, parse_reply_failed(ret));
 	return ret;
+
+fail:
+	stats_counter_add(parser->stats, STATS_ERRORS, 1);
+	return g_strdup("FAIL Message is Invalid");
+}
+
+static gboolean parse_reply_dispatch(gpointer user_data)
+{
+	struct parse_reply* reply = (struct parse_reply*)user_data;
+	struct parse_ctx* parser = reply->parser;
+
+	(*parser->reply_func)(reply->envelope, reply->message, reply->frames, parser->reply_user_data);
+
+	g_free(reply);
+	return FALSE;
+}
+
+static void parse_frame_free(gpointer data)
+{
+	struct parse_frame* frame = (struct parse_frame*)data;
+
+	if (frame->free_func) {
+		(*frame->free_func)(frame->data, frame->hint);
+	}
+
+	g_free(frame);
+}
+
+GPtrArray* parse_frames_new(void)
+{
+	return g_ptr_array_new_with_free_func(parse_frame_free);
+}
+
+void parse_frames_add(GPtrArray* frames, void* data, size_t len, void (*free_func) (void* data, void* hint), void* hint)
+{
+	struct parse_frame* frame = g_new0(struct parse_frame, 1);
+
+	frame->data = data;
+	frame->len = len;
+	frame->free_func = free_func;
+	frame->hint = hint;
+
+	g_ptr_array_add(frames, frame);
+}
+
+void parse_reply_complete(struct parse_reply* reply, char* message)
+{
+	parse_reply_complete_full(reply, message, NULL);
+}
+
+void parse_reply_complete_full(struct parse_reply* reply, char* message, GPtrArray* frames)
+{
+	reply->message = message;
+	reply->frames = frames;
+
+	stats_verb_record(reply->parser->stats, reply->stats,
+		g_get_monotonic_time() - reply->started_at, parse_reply_failed(message));
+
+	/* Sockets belong to the main loop, so that's where we answer from. Don't
+	 * let the answer sit behind every other idle source though */
+	g_idle_add_full(G_PRIORITY_DEFAULT, parse_reply_dispatch, reply, NULL);
 }
 
 static void plugin_entry_free(void* entry)
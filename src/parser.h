@@ -22,12 +22,35 @@
 #define _PARSER_H
 
 struct parse_ctx;
+struct parse_reply;
+struct stats_ctx;
 
 typedef char* (*parse_handler_cb) (const char* prefix, void* ctx);
 
+/* Handlers that may take a while get a reply handle along with the
+ * parameter. They either answer right away by returning non-NULL (and
+ * forgetting the handle), or return NULL and later hand the handle to
+ * parse_reply_complete. The parameter is only valid during the call. */
+typedef char* (*parse_async_handler_cb) (const char* prefix, struct parse_reply* reply, void* ctx);
+
+/* A binary frame sent after the reply text. Whoever sends it calls
+ * free_func(data, hint) once it's done with data, which has the same shape
+ * as ZeroMQ's free callback so frames can go out without a copy. */
+struct parse_frame {
+	void* data;
+	size_t len;
+	void (*free_func) (void* data, void* hint);
+	void* hint;
+};
+
+/* Delivers the answer to a deferred request; always runs on the main loop.
+ * frames is a GPtrArray of parse_frame, or NULL; the callee owns both. */
+typedef void (*parse_reply_func) (void* envelope, char* message, GPtrArray* frames, void* user_data);
+
 struct message_dispatch_entry {
 	const char* prefix;
 	parse_handler_cb op_parse;
+	parse_async_handler_cb op_parse_async;
 };
 
 struct parser_plugin_entry {
@@ -37,11 +60,46 @@ struct parser_plugin_entry {
 	void* (*plugin_new)(void* registrar_ctx);
 	gboolean (*plugin_register)(void* ctx, struct message_dispatch_entry** entries);
 	void (*plugin_free)(void* ctx);
+
+	/* Optional; bracket the commands of a MULTI batch so that a plugin can
+	 * hold its side effects back and apply them all at once on commit */
+	void (*plugin_batch_begin)(void* ctx);
+	void (*plugin_batch_commit)(void* ctx);
 };
 
 struct parse_ctx* parse_new();
 void parse_free(struct parse_ctx* parser);
 gboolean parse_register_plugin(struct parse_ctx* parser, struct parser_plugin_entry* plugin);
-char* parse_message(struct parse_ctx* parser, const char* message);
+void parse_set_reply_func(struct parse_ctx* parser, parse_reply_func func, void* user_data);
+
+/* Every request is timed into stats from here on; set this before
+ * registering plugins so their verbs get histograms */
+void parse_set_stats(struct parse_ctx* parser, struct stats_ctx* stats);
+
+/* NB: message is tokenized in place, so it must be writable. envelope is
+ * whatever the caller needs to route a deferred reply back to its client.
+ * Returns NULL if the reply was deferred.
+ *
+ * "MULTI\n<command>\n<command>..." runs every command in one go, between
+ * each plugin's batch_begin and batch_commit, and answers "OK <count>
+ * failed: <count>" followed by one line per command with that command's
+ * reply; lines of a multi-line reply after the first start with a space.
+ * Commands that reply asynchronously can't be batched, and nothing runs if
+ * any command is malformed or has an unknown verb. That's as far as the
+ * all-or-nothing goes: a command that fails when it runs leaves the ones
+ * before it applied. */
+char* parse_message(struct parse_ctx* parser, char* message, void* envelope);
+
+/* Can be called from any thread; takes ownership of message */
+void parse_reply_complete(struct parse_reply* reply, char* message);
+
+/* Same, but with binary frames to follow the message (see parse_frame),
+ * which may be NULL. Takes ownership of frames, which should be created
+ * with parse_frames_new. */
+void parse_reply_complete_full(struct parse_reply* reply, char* message, GPtrArray* frames);
+
+/* Frames that weren't sent still get their data freed */
+GPtrArray* parse_frames_new(void);
+void parse_frames_add(GPtrArray* frames, void* data, size_t len, void (*free_func) (void* data, void* hint), void* hint);
 
 #endif
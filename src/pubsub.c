@@ -19,16 +19,21 @@
 */
 
 #include <glib.h>
+#include <glib/gprintf.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/uio.h>
 #include <zmq.h>
 
 #include "pubsub.h"
 #include "utility.h"
+#include "stats.h"
+#include "trace.h"
 
 struct pubsub_ctx {
 	void* sock;
 	char* addr;
+	struct stats_ctx* stats;
 };
 
 static char* pubsub_address_from_port(const char* address, int port)
@@ -36,11 +41,13 @@ static char* pubsub_address_from_port(const char* address, int port)
 	return g_strdup_printf("tcp://%s:%d", address, port + 10001);
 }
 
-struct pubsub_ctx* pubsub_new(void* zmq_context, int icecast_port)
+struct pubsub_ctx* pubsub_new(void* zmq_context, int icecast_port, struct stats_ctx* stats)
 {
 	struct pubsub_ctx* ret = g_new0(struct pubsub_ctx, 1);
 	int linger = 15*1000;
 
+	ret->stats = stats;
+
 	ret->sock = zmq_socket(zmq_context, ZMQ_PUB);
 	zmq_setsockopt(ret->sock, ZMQ_LINGER, &linger, sizeof(int));
 
@@ -68,13 +75,64 @@ const char* pubsub_get_address(struct pubsub_ctx* ctx)
 	return ctx->addr;
 }
 
-gboolean pubsub_send_message(struct pubsub_ctx* ctx, const char* message)
+/* Every event is [topic, body]. Subscribers filter on prefixes of the
+ * first frame, so ZeroMQ does the filtering for them */
+gboolean pubsub_send_message_take(struct pubsub_ctx* ctx, const char* topic, char* message, size_t len)
 {
 	zmq_msg_t msg;
-	zmq_msg_init_data(&msg, (void*) strdup(message), sizeof(char) * strlen(message), util_zmq_glib_free, NULL);
-	g_warning("Sending %s to 0x%p", message, ctx->sock);
-	zmq_msg_send(&msg, ctx->sock, 0);
+	size_t topic_len = strlen(topic);
+	gboolean ret = FALSE;
+
+	/* Topics are short enough that ZeroMQ would copy them anyway */
+	zmq_msg_init_size(&msg, topic_len);
+	memcpy(zmq_msg_data(&msg), topic, topic_len);
+
+	if (zmq_msg_send(&msg, ctx->sock, ZMQ_SNDMORE) == -1) {
+		TRACE(TRACE_LEVEL_WARNING, TRACE_PUBLISH_FAILED, NULL, topic, zmq_errno());
+		zmq_msg_close(&msg);
+		g_free(message);
+		return FALSE;
+	}
+
+	zmq_msg_close(&msg);
+
+	/* ZeroMQ hands the buffer back to g_free once it's on the wire */
+	zmq_msg_init_data(&msg, message, len, util_zmq_glib_free, NULL);
+	TRACE(TRACE_LEVEL_DEBUG, TRACE_PUBLISH, NULL, topic, len);
+
+	if (zmq_msg_send(&msg, ctx->sock, 0) == -1) {
+		TRACE(TRACE_LEVEL_WARNING, TRACE_PUBLISH_FAILED, NULL, topic, zmq_errno());
+	} else {
+		ret = TRUE;
+	}
+
 	zmq_msg_close(&msg);
 
-	return TRUE;
+	stats_counter_add(ctx->stats, STATS_PUB_MESSAGES, 1);
+	stats_counter_add(ctx->stats, STATS_PUB_BYTES, topic_len + len);
+
+	return ret;
+}
+
+gboolean pubsub_send_printf(struct pubsub_ctx* ctx, const char* topic, const char* format, ...)
+{
+	va_list args;
+	char* message;
+	int len;
+
+	va_start(args, format);
+	len = g_vasprintf(&message, format, args);
+	va_end(args);
+
+	if (len < 0) {
+		return FALSE;
+	}
+
+	return pubsub_send_message_take(ctx, topic, message, len);
+}
+
+gboolean pubsub_send_message(struct pubsub_ctx* ctx, const char* topic, const char* message)
+{
+	size_t len = strlen(message);
+	return pubsub_send_message_take(ctx, topic, g_memdup(message, len), len);
 }
@@ -21,11 +21,29 @@
 #ifndef _PUBSUB_H
 #define _PUBSUB_H
 
+#include <stddef.h>
+#include <glib.h>
+
 struct pubsub_ctx;
+struct stats_ctx;
 
-struct pubsub_ctx* pubsub_new(void* zmq_context, int icecast_port);
+/* stats may be NULL */
+struct pubsub_ctx* pubsub_new(void* zmq_context, int icecast_port, struct stats_ctx* stats);
 void pubsub_free(struct pubsub_ctx* ctx);
 const char* pubsub_get_address(struct pubsub_ctx* ctx);
-gboolean pubsub_send_message(struct pubsub_ctx* ctx, const char* message);
+/* Events go out as a topic frame followed by the message. Topics are
+ * slash-separated and most general first (e.g. "pipeline/error",
+ * "player/<id>/preloaded", "scan/<id>/done") so that subscribers can pick
+ * what they want with a ZMQ_SUBSCRIBE prefix. */
+
+/* Copies message; prefer the two below on hot paths */
+gboolean pubsub_send_message(struct pubsub_ctx* ctx, const char* topic, const char* message);
+
+/* Sends message (which must come from g_malloc, and need not be
+ * NUL-terminated) without copying it and g_frees it when ZeroMQ is done */
+gboolean pubsub_send_message_take(struct pubsub_ctx* ctx, const char* topic, char* message, size_t len);
+
+/* Formats straight into the buffer that goes out */
+gboolean pubsub_send_printf(struct pubsub_ctx* ctx, const char* topic, const char* format, ...) G_GNUC_PRINTF(3, 4);
 
 #endif
@@ -0,0 +1,176 @@
+/*
+   slot-table.c - Generation-tagged table of objects addressed by id
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "slot-table.h"
+
+#define SLOT_INDEX_MASK (SLOT_TABLE_MAX_SLOTS - 1)
+#define SLOT_GENERATION_MAX (G_MAXUINT64 >> SLOT_TABLE_INDEX_BITS)
+
+struct slot {
+	guint64 generation;
+	gpointer data;
+};
+
+struct slot_table {
+	GArray* slots;		/* of struct slot */
+	GQueue free_slots;	/* of slot indices, oldest first */
+	guint count;
+};
+
+static inline guint64 slot_make_id(guint index, guint64 generation)
+{
+	return (generation << SLOT_TABLE_INDEX_BITS) | index;
+}
+
+static struct slot* slot_from_id(struct slot_table* table, guint64 id)
+{
+	guint index = id & SLOT_INDEX_MASK;
+	struct slot* ret;
+
+	if (id == 0 || index >= table->slots->len) {
+		return NULL;
+	}
+
+	ret = &g_array_index(table->slots, struct slot, index);
+	if (!ret->data || ret->generation != (id >> SLOT_TABLE_INDEX_BITS)) {
+		return NULL;
+	}
+
+	return ret;
+}
+
+struct slot_table* slot_table_new(void)
+{
+	struct slot_table* ret = g_new0(struct slot_table, 1);
+
+	ret->slots = g_array_new(FALSE, TRUE, sizeof(struct slot));
+	g_queue_init(&ret->free_slots);
+	return ret;
+}
+
+void slot_table_free(struct slot_table* table)
+{
+	if (!table) {
+		return;
+	}
+
+	g_array_free(table->slots, TRUE);
+	g_queue_clear(&table->free_slots);
+	g_free(table);
+}
+
+guint64 slot_table_insert(struct slot_table* table, gpointer data)
+{
+	struct slot* slot;
+	guint index;
+
+	g_return_val_if_fail(data != NULL, 0);
+
+	/* NB: Growing while there's room means a client that plays and stops
+	 * one source at a time gets a new slot each time, not the same one */
+	if (g_queue_get_length(&table->free_slots) >= SLOT_TABLE_MIN_FREE ||
+	    (table->slots->len >= SLOT_TABLE_MAX_SLOTS && !g_queue_is_empty(&table->free_slots))) {
+		index = GPOINTER_TO_UINT(g_queue_pop_head(&table->free_slots));
+	} else {
+		if (table->slots->len >= SLOT_TABLE_MAX_SLOTS) {
+			return 0;
+		}
+
+		/* Generations start at 1 so that no id is ever 0 */
+		struct slot empty = { 1, NULL };
+		index = table->slots->len;
+		g_array_append_val(table->slots, empty);
+	}
+
+	slot = &g_array_index(table->slots, struct slot, index);
+	slot->data = data;
+	table->count++;
+
+	return slot_make_id(index, slot->generation);
+}
+
+gpointer slot_table_lookup(struct slot_table* table, guint64 id)
+{
+	struct slot* slot = slot_from_id(table, id);
+	return (slot ? slot->data : NULL);
+}
+
+gpointer slot_table_remove(struct slot_table* table, guint64 id)
+{
+	struct slot* slot = slot_from_id(table, id);
+	gpointer ret;
+	guint index = id & SLOT_INDEX_MASK;
+
+	if (!slot) {
+		return NULL;
+	}
+
+	ret = slot->data;
+	slot->data = NULL;
+	table->count--;
+
+	/* Wrapping would bring back ids that are already out there */
+	if (slot->generation < SLOT_GENERATION_MAX) {
+		slot->generation++;
+		g_queue_push_tail(&table->free_slots, GUINT_TO_POINTER(index));
+	}
+
+	return ret;
+}
+
+guint slot_table_count(struct slot_table* table)
+{
+	return table->count;
+}
+
+void slot_table_foreach(struct slot_table* table, slot_table_func func, gpointer user_data)
+{
+	guint i;
+
+	for (i = 0; i < table->slots->len; i++) {
+		struct slot* slot = &g_array_index(table->slots, struct slot, i);
+
+		if (slot->data) {
+			func(slot_make_id(i, slot->generation), slot->data, user_data);
+		}
+	}
+}
+
+guint64 slot_table_id_from_string(const char* str)
+{
+	char* end = NULL;
+	guint64 ret;
+
+	if (!str || !g_ascii_isdigit(*str)) {
+		return 0;
+	}
+
+	errno = 0;
+	ret = g_ascii_strtoull(str, &end, 10);
+	if (errno || (*end && !g_ascii_isspace(*end))) {
+		return 0;
+	}
+
+	return ret;
+}
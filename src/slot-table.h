@@ -0,0 +1,55 @@
+/*
+   slot-table.h - Generation-tagged table of objects addressed by id
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _SLOT_TABLE_H
+#define _SLOT_TABLE_H
+
+#include <glib.h>
+
+/* An id is a slot index in the low bits and that slot's generation in the
+ * high bits. Freeing a slot bumps its generation, so stale ids never
+ * resolve to whatever reuses the slot; a slot whose generation runs out
+ * is retired rather than wrapped. Freed slots are reused oldest first, and
+ * only once SLOT_TABLE_MIN_FREE of them have piled up, so reuse rotates
+ * through the table instead of hammering one slot. Ids are never zero. */
+#define SLOT_TABLE_INDEX_BITS 16
+#define SLOT_TABLE_MAX_SLOTS (1 << SLOT_TABLE_INDEX_BITS)
+#define SLOT_TABLE_MIN_FREE 1024
+
+struct slot_table;
+
+typedef void (*slot_table_func)(guint64 id, gpointer data, gpointer user_data);
+
+struct slot_table* slot_table_new(void);
+void slot_table_free(struct slot_table* table);
+
+/* Returns 0 if the table is full */
+guint64 slot_table_insert(struct slot_table* table, gpointer data);
+
+gpointer slot_table_lookup(struct slot_table* table, guint64 id);
+gpointer slot_table_remove(struct slot_table* table, guint64 id);
+
+guint slot_table_count(struct slot_table* table);
+void slot_table_foreach(struct slot_table* table, slot_table_func func, gpointer user_data);
+
+/* Parses a decimal id as sent by clients; returns 0 if it isn't one */
+guint64 slot_table_id_from_string(const char* str);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+   stats.c - Request timing and daemon-wide counters
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "stats.h"
+
+/* GLib's atomics only come in int and pointer sizes, and byte counts
+ * outgrow an int quickly */
+#define atomic_add64(p, v) __sync_fetch_and_add((p), (v))
+#define atomic_get64(p) __sync_fetch_and_add((p), 0)
+
+static const char* counter_names[STATS_COUNTER_COUNT] = {
+	"errors",
+	"active-sources",
+	"bus-messages",
+	"pub-messages",
+	"pub-bytes",
+	"mix-renegotiations",
+	"convert-ns",
+};
+
+struct stats_verb {
+	char* name;
+
+	volatile gint64 count;
+	volatile gint64 failures;
+	volatile gint64 total_usec;
+	volatile gint64 max_usec;
+	volatile gint buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+struct stats_ctx {
+	gint64 started_at;
+	GPtrArray* verbs;	/* of stats_verb */
+	volatile gint64 counters[STATS_COUNTER_COUNT];
+};
+
+static guint stats_bucket_for(gint64 usec)
+{
+	guint ret = 0;
+
+	while (usec > 0 && ret < STATS_HISTOGRAM_BUCKETS - 1) {
+		usec >>= 1;
+		ret++;
+	}
+
+	return ret;
+}
+
+static void stats_verb_free(gpointer data)
+{
+	struct stats_verb* verb = data;
+
+	g_free(verb->name);
+	g_free(verb);
+}
+
+struct stats_ctx* stats_new(void)
+{
+	struct stats_ctx* ret = g_new0(struct stats_ctx, 1);
+
+	ret->started_at = g_get_monotonic_time();
+	ret->verbs = g_ptr_array_new_with_free_func(stats_verb_free);
+
+	return ret;
+}
+
+void stats_free(struct stats_ctx* stats)
+{
+	if (!stats) {
+		return;
+	}
+
+	g_ptr_array_free(stats->verbs, TRUE);
+	g_free(stats);
+}
+
+struct stats_verb* stats_register_verb(struct stats_ctx* stats, const char* name)
+{
+	struct stats_verb* ret;
+	guint i;
+
+	if (!stats) {
+		return NULL;
+	}
+
+	for (i = 0; i < stats->verbs->len; i++) {
+		ret = g_ptr_array_index(stats->verbs, i);
+		if (!strcmp(ret->name, name)) {
+			return ret;
+		}
+	}
+
+	ret = g_new0(struct stats_verb, 1);
+	ret->name = g_strdup(name);
+	g_ptr_array_add(stats->verbs, ret);
+
+	return ret;
+}
+
+void stats_verb_record(struct stats_ctx* stats, struct stats_verb* verb, gint64 usec, gboolean failed)
+{
+	gint64 max;
+
+	if (!stats || !verb) {
+		return;
+	}
+
+	atomic_add64(&verb->count, 1);
+	atomic_add64(&verb->total_usec, usec);
+	g_atomic_int_inc(&verb->buckets[stats_bucket_for(usec)]);
+
+	if (failed) {
+		atomic_add64(&verb->failures, 1);
+		atomic_add64(&stats->counters[STATS_ERRORS], 1);
+	}
+
+	max = verb->max_usec;
+	while (usec > max && !__sync_bool_compare_and_swap(&verb->max_usec, max, usec)) {
+		max = verb->max_usec;
+	}
+}
+
+void stats_counter_add(struct stats_ctx* stats, enum stats_counter counter, gint64 delta)
+{
+	if (stats) {
+		atomic_add64(&stats->counters[counter], delta);
+	}
+}
+
+void stats_counter_set(struct stats_ctx* stats, enum stats_counter counter, gint64 value)
+{
+	gint64 old;
+
+	if (!stats) {
+		return;
+	}
+
+	do {
+		old = stats->counters[counter];
+	} while (!__sync_bool_compare_and_swap(&stats->counters[counter], old, value));
+}
+
+/* Upper bound of the bucket that the p'th sample falls in */
+static gint64 stats_percentile_usec(const gint* buckets, gint64 count, double p)
+{
+	gint64 seen = 0, target = (gint64)(p * count + 0.5);
+	guint i;
+
+	if (target < 1) target = 1;
+
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			return (i == 0 ? 1 : (gint64)1 << i);
+		}
+	}
+
+	return (gint64)1 << (STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+char* stats_snapshot(struct stats_ctx* stats)
+{
+	GString* ret = g_string_new("");
+	gint buckets[STATS_HISTOGRAM_BUCKETS];
+	guint i, j;
+
+	g_string_append_printf(ret, "uptime: %.1f\n", (g_get_monotonic_time() - stats->started_at) / (double)G_USEC_PER_SEC);
+
+	for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+		g_string_append_printf(ret, "%s: %" G_GINT64_FORMAT "\n", counter_names[i], atomic_get64(&stats->counters[i]));
+	}
+
+	for (i = 0; i < stats->verbs->len; i++) {
+		struct stats_verb* verb = g_ptr_array_index(stats->verbs, i);
+		gint64 count = 0;
+
+		/* The buckets are read one at a time, so take the count from
+		 * them rather than from verb->count to keep the line consistent */
+		for (j = 0; j < STATS_HISTOGRAM_BUCKETS; j++) {
+			buckets[j] = g_atomic_int_get(&verb->buckets[j]);
+			count += buckets[j];
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		g_string_append_printf(ret, "%s count: %" G_GINT64_FORMAT " errors: %" G_GINT64_FORMAT
+			" mean-us: %" G_GINT64_FORMAT " p50-us: %" G_GINT64_FORMAT " p99-us: %" G_GINT64_FORMAT
+			" p999-us: %" G_GINT64_FORMAT " max-us: %" G_GINT64_FORMAT " buckets:",
+			verb->name, count, atomic_get64(&verb->failures),
+			atomic_get64(&verb->total_usec) / MAX(atomic_get64(&verb->count), 1),
+			stats_percentile_usec(buckets, count, 0.50),
+			stats_percentile_usec(buckets, count, 0.99),
+			stats_percentile_usec(buckets, count, 0.999),
+			atomic_get64(&verb->max_usec));
+
+		/* Trailing empty buckets are just noise */
+		for (j = STATS_HISTOGRAM_BUCKETS; j > 0 && buckets[j-1] == 0; j--);
+		for (guint k = 0; k < j; k++) {
+			g_string_append_printf(ret, "%c%d", (k ? ',' : ' '), buckets[k]);
+		}
+
+		g_string_append_c(ret, '\n');
+	}
+
+	return g_string_free(ret, FALSE);
+}
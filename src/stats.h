@@ -0,0 +1,60 @@
+/*
+   stats.h - Request timing and daemon-wide counters
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <glib.h>
+
+/* Bucket 0 counts anything under 1us, bucket i (i > 0) counts
+ * [2^(i-1), 2^i) microseconds; the last bucket takes everything longer */
+#define STATS_HISTOGRAM_BUCKETS 32
+
+enum stats_counter {
+	STATS_ERRORS,
+	STATS_ACTIVE_SOURCES,
+	STATS_BUS_MESSAGES,
+	STATS_PUB_MESSAGES,
+	STATS_PUB_BYTES,
+	STATS_MIX_RENEGOTIATIONS,
+	STATS_CONVERT_NSEC,
+	STATS_COUNTER_COUNT,
+};
+
+struct stats_ctx;
+struct stats_verb;
+
+struct stats_ctx* stats_new(void);
+void stats_free(struct stats_ctx* stats);
+
+/* Registration happens on the main thread before any requests come in;
+ * registering the same verb twice gets you the same histogram */
+struct stats_verb* stats_register_verb(struct stats_ctx* stats, const char* verb);
+
+/* Everything below is lock-free and can be called from any thread. stats
+ * may be NULL, which makes them no-ops. */
+void stats_verb_record(struct stats_ctx* stats, struct stats_verb* verb, gint64 usec, gboolean failed);
+void stats_counter_add(struct stats_ctx* stats, enum stats_counter counter, gint64 delta);
+void stats_counter_set(struct stats_ctx* stats, enum stats_counter counter, gint64 value);
+
+/* One counter per line, then one line per verb that has seen traffic */
+char* stats_snapshot(struct stats_ctx* stats);
+
+#endif
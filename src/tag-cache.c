@@ -0,0 +1,507 @@
+/*
+   tag-cache.c - Persistent cache of media tags
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "tag-cache.h"
+
+#define TAG_CACHE_MAGIC "GPTC"
+#define TAG_CACHE_VERSION 2
+
+/* Don't bother compacting the store until this much of it is dead */
+#define TAG_CACHE_COMPACT_THRESHOLD (1024 * 1024)
+
+/* What a file looked like when its tags were read; if any of it has
+ * changed, so might the tags */
+struct tag_cache_stamp {
+	guint64 mtime;
+	guint64 size;
+	guint64 inode;
+};
+
+struct tag_cache_key {
+	char* uri;
+	struct tag_cache_stamp stamp;
+};
+
+/* The on-disk store is a header followed by an append-only log of records,
+ * each one a URI, its stamp and a serialized GstTagList. If a URI shows up
+ * more than once, the last record wins, so a file that's been edited
+ * replaces its old record rather than adding another one. The log is
+ * mapped at startup; anything appended after that is read back with
+ * pread. */
+struct tag_cache_header {
+	char magic[4];
+	guint32 version;
+};
+
+struct tag_cache_record {
+	guint32 key_len;
+	guint32 value_len;
+	struct tag_cache_stamp stamp;
+};
+
+struct disk_entry {
+	guint64 offset;		/* of the value */
+	guint32 len;
+	struct tag_cache_stamp stamp;
+};
+
+struct cache_entry {
+	char* key;		/* the URI */
+	struct tag_cache_stamp stamp;
+	GstTagList* tags;
+	GList* link;		/* our node in tag_cache.lru */
+};
+
+struct tag_cache {
+	GMutex* lock;
+
+	guint max_entries;
+	GHashTable* entries;	/* key -> cache_entry */
+	GQueue lru;		/* cache_entry, most recently used first */
+
+	char* path;
+	int fd;
+	GMappedFile* map;
+	gsize map_len;
+	guint64 file_len;
+	GHashTable* disk_index;	/* key -> disk_entry */
+
+	guint64 hits;
+	guint64 disk_hits;
+	guint64 misses;
+};
+
+static void cache_entry_free(gpointer data)
+{
+	struct cache_entry* entry = (struct cache_entry*)data;
+
+	gst_tag_list_free(entry->tags);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+static gboolean tag_cache_reset_store(struct tag_cache* cache)
+{
+	struct tag_cache_header header;
+
+	memcpy(header.magic, TAG_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TAG_CACHE_VERSION;
+
+	if (ftruncate(cache->fd, 0) == -1 || pwrite(cache->fd, &header, sizeof(header), 0) != sizeof(header)) {
+		g_warning("Failed to initialize tag cache %s: %s", cache->path, g_strerror(errno));
+		return FALSE;
+	}
+
+	g_hash_table_remove_all(cache->disk_index);
+	cache->file_len = sizeof(header);
+	return TRUE;
+}
+
+static guint64 tag_cache_index_store(struct tag_cache* cache, const char* data, gsize len, guint64* dead_bytes)
+{
+	guint64 offset = sizeof(struct tag_cache_header);
+	struct tag_cache_record record;
+
+	*dead_bytes = 0;
+	while (offset + sizeof(record) <= len) {
+		struct disk_entry* entry;
+		struct disk_entry* old;
+		char* key;
+
+		memcpy(&record, data + offset, sizeof(record));
+
+		/* A torn write at the end of the log, we'll write over it */
+		if (offset + sizeof(record) + record.key_len + record.value_len > len) {
+			break;
+		}
+
+		key = g_strndup(data + offset + sizeof(record), record.key_len);
+		entry = g_new0(struct disk_entry, 1);
+		entry->offset = offset + sizeof(record) + record.key_len;
+		entry->len = record.value_len;
+		entry->stamp = record.stamp;
+
+		if ((old = g_hash_table_lookup(cache->disk_index, key))) {
+			*dead_bytes += sizeof(record) + record.key_len + old->len;
+		}
+
+		g_hash_table_replace(cache->disk_index, key, entry);
+		offset += sizeof(record) + record.key_len + record.value_len;
+	}
+
+	return offset;
+}
+
+static gboolean tag_cache_compact_store(struct tag_cache* cache, const char* data)
+{
+	struct tag_cache_header header;
+	struct tag_cache_record record;
+	GHashTableIter iter;
+	gpointer key, value;
+	gboolean ret = FALSE;
+
+	char* tmp_path = g_strdup_printf("%s.tmp", cache->path);
+	FILE* out = fopen(tmp_path, "wb");
+
+	if (!out) {
+		g_warning("Couldn't compact tag cache %s: %s", cache->path, g_strerror(errno));
+		goto out;
+	}
+
+	memcpy(header.magic, TAG_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TAG_CACHE_VERSION;
+	fwrite(&header, sizeof(header), 1, out);
+
+	g_hash_table_iter_init(&iter, cache->disk_index);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct disk_entry* entry = value;
+
+		record.key_len = strlen(key);
+		record.value_len = entry->len;
+		record.stamp = entry->stamp;
+		fwrite(&record, sizeof(record), 1, out);
+		fwrite(key, record.key_len, 1, out);
+		fwrite(data + entry->offset, entry->len, 1, out);
+	}
+
+	if (fclose(out) != 0 || rename(tmp_path, cache->path) == -1) {
+		g_warning("Couldn't compact tag cache %s: %s", cache->path, g_strerror(errno));
+		unlink(tmp_path);
+		goto out;
+	}
+
+	ret = TRUE;
+
+out:
+	g_free(tmp_path);
+	return ret;
+}
+
+static void tag_cache_open_store(struct tag_cache* cache, gboolean allow_compact)
+{
+	GError* err = NULL;
+	struct stat st;
+	const char* data;
+	guint64 dead_bytes;
+
+	if ((cache->fd = open(cache->path, O_RDWR | O_CREAT, 0644)) == -1) {
+		g_warning("Couldn't open tag cache %s: %s", cache->path, g_strerror(errno));
+		return;
+	}
+
+	if (fstat(cache->fd, &st) == -1 || st.st_size < (off_t)sizeof(struct tag_cache_header)) {
+		goto reset;
+	}
+
+	if (!(cache->map = g_mapped_file_new(cache->path, FALSE, &err))) {
+		g_warning("Couldn't map tag cache %s: %s", cache->path, err->message);
+		g_error_free(err);
+		goto reset;
+	}
+
+	data = g_mapped_file_get_contents(cache->map);
+	cache->map_len = g_mapped_file_get_length(cache->map);
+
+	if (memcmp(data, TAG_CACHE_MAGIC, 4) != 0 ||
+	    ((const struct tag_cache_header*)data)->version != TAG_CACHE_VERSION) {
+		g_warning("Tag cache %s is from another version, starting over", cache->path);
+		goto reset;
+	}
+
+	cache->file_len = tag_cache_index_store(cache, data, cache->map_len, &dead_bytes);
+
+	if (allow_compact && dead_bytes > TAG_CACHE_COMPACT_THRESHOLD &&
+	    dead_bytes > cache->file_len - dead_bytes && tag_cache_compact_store(cache, data)) {
+		g_mapped_file_unref(cache->map);
+		cache->map = NULL;
+		cache->map_len = 0;
+		close(cache->fd);
+		g_hash_table_remove_all(cache->disk_index);
+
+		tag_cache_open_store(cache, FALSE);
+		return;
+	}
+
+	/* Anything past the last good record gets overwritten by appends, so
+	 * don't trust the mapping for it */
+	if (cache->file_len < (guint64)st.st_size) {
+		cache->map_len = cache->file_len;
+
+		if (ftruncate(cache->fd, cache->file_len) == -1) {
+			g_warning("Couldn't trim tag cache %s: %s", cache->path, g_strerror(errno));
+		}
+	}
+
+	return;
+
+reset:
+	if (cache->map) {
+		g_mapped_file_unref(cache->map);
+		cache->map = NULL;
+		cache->map_len = 0;
+	}
+
+	if (!tag_cache_reset_store(cache)) {
+		close(cache->fd);
+		cache->fd = -1;
+	}
+}
+
+struct tag_cache* tag_cache_new(const char* path, guint max_entries)
+{
+	struct tag_cache* ret = g_new0(struct tag_cache, 1);
+
+	ret->lock = g_mutex_new();
+	ret->max_entries = MAX(max_entries, 1);
+	ret->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, cache_entry_free);
+	g_queue_init(&ret->lru);
+
+	ret->fd = -1;
+	ret->disk_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (path && *path) {
+		ret->path = g_strdup(path);
+		tag_cache_open_store(ret, TRUE);
+	}
+
+	return ret;
+}
+
+void tag_cache_free(struct tag_cache* cache)
+{
+	if (cache->fd != -1) close(cache->fd);
+	if (cache->map) g_mapped_file_unref(cache->map);
+
+	g_queue_clear(&cache->lru);
+	g_hash_table_destroy(cache->entries);
+	g_hash_table_destroy(cache->disk_index);
+
+	g_mutex_free(cache->lock);
+	g_free(cache->path);
+	g_free(cache);
+}
+
+struct tag_cache_key* tag_cache_key_for_uri(const char* uri)
+{
+	struct tag_cache_key* ret = NULL;
+	struct stat st;
+	char* filename;
+
+	/* Only local files have an identity we can check. Anything else
+	 * (especially streams) could change out from under us. */
+	if (!(filename = g_filename_from_uri(uri, NULL, NULL))) {
+		return NULL;
+	}
+
+	if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+		ret = g_new0(struct tag_cache_key, 1);
+		ret->uri = g_strdup(uri);
+		ret->stamp.mtime = st.st_mtime;
+		ret->stamp.size = st.st_size;
+		ret->stamp.inode = st.st_ino;
+	}
+
+	g_free(filename);
+	return ret;
+}
+
+void tag_cache_key_free(struct tag_cache_key* key)
+{
+	if (!key) {
+		return;
+	}
+
+	g_free(key->uri);
+	g_free(key);
+}
+
+static gboolean tag_cache_stamp_equal(const struct tag_cache_stamp* lhs, const struct tag_cache_stamp* rhs)
+{
+	return (lhs->mtime == rhs->mtime && lhs->size == rhs->size && lhs->inode == rhs->inode);
+}
+
+/* Must be called with the lock held; takes ownership of tags */
+static void tag_cache_add_entry(struct tag_cache* cache, const struct tag_cache_key* key, GstTagList* tags)
+{
+	struct cache_entry* entry;
+
+	if ((entry = g_hash_table_lookup(cache->entries, key->uri))) {
+		gst_tag_list_free(entry->tags);
+		entry->tags = tags;
+		entry->stamp = key->stamp;
+
+		g_queue_unlink(&cache->lru, entry->link);
+		g_queue_push_head_link(&cache->lru, entry->link);
+		return;
+	}
+
+	entry = g_new0(struct cache_entry, 1);
+	entry->key = g_strdup(key->uri);
+	entry->stamp = key->stamp;
+	entry->tags = tags;
+
+	g_queue_push_head(&cache->lru, entry);
+	entry->link = cache->lru.head;
+	g_hash_table_insert(cache->entries, entry->key, entry);
+
+	while (g_queue_get_length(&cache->lru) > cache->max_entries) {
+		struct cache_entry* victim = g_queue_pop_tail(&cache->lru);
+		g_hash_table_remove(cache->entries, victim->key);
+	}
+}
+
+/* Must be called with the lock held */
+static GstTagList* tag_cache_read_disk_entry(struct tag_cache* cache, struct disk_entry* entry)
+{
+	GstStructure* ret;
+	char* value = g_new0(char, entry->len + 1);
+
+	if (cache->map && entry->offset + entry->len <= cache->map_len) {
+		memcpy(value, g_mapped_file_get_contents(cache->map) + entry->offset, entry->len);
+	} else if (pread(cache->fd, value, entry->len, entry->offset) != (ssize_t)entry->len) {
+		g_warning("Failed to read from tag cache %s", cache->path);
+		g_free(value);
+		return NULL;
+	}
+
+	ret = gst_structure_from_string(value, NULL);
+	g_free(value);
+
+	if (ret && !gst_is_tag_list(ret)) {
+		gst_structure_free(ret);
+		ret = NULL;
+	}
+
+	return (GstTagList*)ret;
+}
+
+GstTagList* tag_cache_lookup(struct tag_cache* cache, const struct tag_cache_key* key)
+{
+	struct cache_entry* entry;
+	struct disk_entry* disk;
+	GstTagList* tags;
+	GstTagList* ret = NULL;
+
+	g_mutex_lock(cache->lock);
+
+	/* The file has changed since; whoever missed will insert a fresh one */
+	if ((entry = g_hash_table_lookup(cache->entries, key->uri)) && !tag_cache_stamp_equal(&entry->stamp, &key->stamp)) {
+		g_queue_delete_link(&cache->lru, entry->link);
+		g_hash_table_remove(cache->entries, key->uri);
+		entry = NULL;
+	}
+
+	if (entry) {
+		g_queue_unlink(&cache->lru, entry->link);
+		g_queue_push_head_link(&cache->lru, entry->link);
+
+		cache->hits++;
+		ret = gst_tag_list_copy(entry->tags);
+		goto out;
+	}
+
+	if ((disk = g_hash_table_lookup(cache->disk_index, key->uri)) &&
+	    tag_cache_stamp_equal(&disk->stamp, &key->stamp) &&
+	    (tags = tag_cache_read_disk_entry(cache, disk))) {
+		cache->hits++;
+		cache->disk_hits++;
+
+		ret = gst_tag_list_copy(tags);
+		tag_cache_add_entry(cache, key, tags);
+		goto out;
+	}
+
+	cache->misses++;
+
+out:
+	g_mutex_unlock(cache->lock);
+	return ret;
+}
+
+/* Must be called with the lock held */
+static void tag_cache_append_to_store(struct tag_cache* cache, const struct tag_cache_key* key, const char* value)
+{
+	struct tag_cache_record record;
+	struct disk_entry* entry;
+	guint64 offset = cache->file_len;
+
+	record.key_len = strlen(key->uri);
+	record.value_len = strlen(value);
+	record.stamp = key->stamp;
+
+	if (pwrite(cache->fd, &record, sizeof(record), offset) != sizeof(record) ||
+	    pwrite(cache->fd, key->uri, record.key_len, offset + sizeof(record)) != (ssize_t)record.key_len ||
+	    pwrite(cache->fd, value, record.value_len, offset + sizeof(record) + record.key_len) != (ssize_t)record.value_len) {
+		g_warning("Failed to write to tag cache %s: %s", cache->path, g_strerror(errno));
+		return;
+	}
+
+	entry = g_new0(struct disk_entry, 1);
+	entry->offset = offset + sizeof(record) + record.key_len;
+	entry->len = record.value_len;
+	entry->stamp = key->stamp;
+
+	/* Whatever the URI had before is dead now, and gets dropped the next
+	 * time the store is compacted */
+	g_hash_table_replace(cache->disk_index, g_strdup(key->uri), entry);
+	cache->file_len = entry->offset + entry->len;
+}
+
+void tag_cache_insert(struct tag_cache* cache, const struct tag_cache_key* key, const GstTagList* tags)
+{
+	char* value = NULL;
+
+	/* Serialize outside the lock, cover art can make this expensive */
+	if (cache->fd != -1) {
+		value = gst_structure_to_string((const GstStructure*)tags);
+	}
+
+	g_mutex_lock(cache->lock);
+
+	tag_cache_add_entry(cache, key, gst_tag_list_copy(tags));
+	if (value) tag_cache_append_to_store(cache, key, value);
+
+	g_mutex_unlock(cache->lock);
+
+	g_free(value);
+}
+
+void tag_cache_get_stats(struct tag_cache* cache, struct tag_cache_stats* stats)
+{
+	g_mutex_lock(cache->lock);
+
+	stats->hits = cache->hits;
+	stats->disk_hits = cache->disk_hits;
+	stats->misses = cache->misses;
+	stats->entries = g_hash_table_size(cache->entries);
+	stats->disk_entries = g_hash_table_size(cache->disk_index);
+
+	g_mutex_unlock(cache->lock);
+}
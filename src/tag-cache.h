@@ -0,0 +1,55 @@
+/*
+   tag-cache.h - Persistent cache of media tags
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _TAG_CACHE_H
+#define _TAG_CACHE_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+struct tag_cache;
+struct tag_cache_key;
+
+struct tag_cache_stats {
+	guint64 hits;
+	guint64 disk_hits;
+	guint64 misses;
+	guint entries;
+	guint disk_entries;
+};
+
+/* path may be NULL for a memory-only cache */
+struct tag_cache* tag_cache_new(const char* path, guint max_entries);
+void tag_cache_free(struct tag_cache* cache);
+
+/* The URI along with what the file looks like right now; returns NULL if
+ * the URI can't be cached (i.e. it isn't a local file) */
+struct tag_cache_key* tag_cache_key_for_uri(const char* uri);
+void tag_cache_key_free(struct tag_cache_key* key);
+
+/* Both are thread-safe. Entries are per URI: lookup misses if the file has
+ * changed since its entry was inserted, and insert replaces whatever the
+ * URI had before. lookup returns a copy that the caller owns */
+GstTagList* tag_cache_lookup(struct tag_cache* cache, const struct tag_cache_key* key);
+void tag_cache_insert(struct tag_cache* cache, const struct tag_cache_key* key, const GstTagList* tags);
+
+void tag_cache_get_stats(struct tag_cache* cache, struct tag_cache_stats* stats);
+
+#endif
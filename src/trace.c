@@ -0,0 +1,214 @@
+/*
+   trace.c - Low overhead binary tracing
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "trace.h"
+
+/* Per thread; must be a power of two */
+#define TRACE_RING_SIZE 1024
+#define TRACE_TEXT_LEN 24
+
+/* Each thread writes to a ring of its own, so writers never contend. A
+ * reader can race with the writer though, so every record carries a
+ * sequence number that's zeroed while the record is being filled in and
+ * set to (position + 1) once it's done; if it doesn't match before and
+ * after the reader copies the record, the record is skipped. */
+struct trace_record {
+	volatile guint64 seq;
+	gint64 timestamp;
+	const char* str;
+	gint64 arg;
+	guint16 event;
+	guint16 level;
+	char text[TRACE_TEXT_LEN];
+};
+
+struct trace_ring {
+	guint id;
+	volatile guint64 head;
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+struct trace_event_info {
+	const char* name;
+	const char* arg_name;
+};
+
+static const struct trace_event_info event_info[TRACE_EVENT_COUNT] = {
+	{ "request", "len" },
+	{ "reply", "len" },
+	{ "invalid-request", "len" },
+	{ "publish", "len" },
+	{ "publish-failed", "errno" },
+	{ "bus-message", NULL },
+	{ "tag", NULL },
+};
+
+static const char* level_names[] = { "", "ERROR", "WARNING", "INFO", "DEBUG" };
+
+static __thread struct trace_ring* current_ring;
+
+/* Rings outlive their threads so that TRACE can still see what a worker
+ * was doing; a thread that exits hands its ring to the next one to start */
+static GStaticMutex rings_lock = G_STATIC_MUTEX_INIT;
+static GStaticPrivate ring_owner = G_STATIC_PRIVATE_INIT;
+static GPtrArray* all_rings;
+static GSList* free_rings;
+static gint64 trace_epoch;
+
+static void trace_ring_release(gpointer data)
+{
+	g_static_mutex_lock(&rings_lock);
+	free_rings = g_slist_prepend(free_rings, data);
+	g_static_mutex_unlock(&rings_lock);
+}
+
+static struct trace_ring* trace_ring_acquire(void)
+{
+	struct trace_ring* ret;
+
+	g_static_mutex_lock(&rings_lock);
+
+	if (!all_rings) {
+		all_rings = g_ptr_array_new();
+		trace_epoch = g_get_monotonic_time();
+	}
+
+	if (free_rings) {
+		ret = free_rings->data;
+		free_rings = g_slist_delete_link(free_rings, free_rings);
+	} else {
+		ret = g_new0(struct trace_ring, 1);
+		ret->id = all_rings->len;
+		g_ptr_array_add(all_rings, ret);
+	}
+
+	g_static_mutex_unlock(&rings_lock);
+
+	g_static_private_set(&ring_owner, ret, trace_ring_release);
+	return ret;
+}
+
+void trace_write(enum trace_level level, enum trace_event event, const char* static_str, const char* text, gint64 arg)
+{
+	struct trace_ring* ring = current_ring;
+	struct trace_record* rec;
+	guint64 pos;
+	size_t len;
+
+	if (G_UNLIKELY(!ring)) {
+		ring = current_ring = trace_ring_acquire();
+	}
+
+	pos = ring->head;
+	rec = &ring->records[pos & (TRACE_RING_SIZE - 1)];
+
+	rec->seq = 0;
+	__sync_synchronize();
+
+	rec->timestamp = g_get_monotonic_time();
+	rec->str = static_str;
+	rec->arg = arg;
+	rec->event = event;
+	rec->level = level;
+
+	len = (text ? strnlen(text, TRACE_TEXT_LEN - 1) : 0);
+	memcpy(rec->text, text, len);
+	rec->text[len] = '\0';
+
+	__sync_synchronize();
+	rec->seq = pos + 1;
+	ring->head = pos + 1;
+}
+
+static gint compare_records(gconstpointer lhs, gconstpointer rhs)
+{
+	const struct trace_record* l = lhs;
+	const struct trace_record* r = rhs;
+
+	return (l->timestamp > r->timestamp) - (l->timestamp < r->timestamp);
+}
+
+static void trace_collect(struct trace_ring* ring, GArray* out, GArray* ring_ids)
+{
+	guint64 head = ring->head;
+	guint64 pos = (head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+
+	for (; pos < head; pos++) {
+		struct trace_record* rec = &ring->records[pos & (TRACE_RING_SIZE - 1)];
+		struct trace_record copy;
+
+		if (rec->seq != pos + 1) continue;
+		__sync_synchronize();
+
+		memcpy(&copy, rec, sizeof(copy));
+
+		__sync_synchronize();
+		if (rec->seq != pos + 1) continue;
+
+		g_array_append_val(out, copy);
+		g_array_append_val(ring_ids, ring->id);
+	}
+}
+
+char* trace_decode(guint max_records)
+{
+	GString* ret = g_string_new("");
+	GArray* records = g_array_new(FALSE, FALSE, sizeof(struct trace_record));
+	GArray* ring_ids = g_array_new(FALSE, FALSE, sizeof(guint));
+	guint i, start;
+
+	g_static_mutex_lock(&rings_lock);
+	for (i = 0; all_rings && i < all_rings->len; i++) {
+		trace_collect(g_ptr_array_index(all_rings, i), records, ring_ids);
+	}
+	g_static_mutex_unlock(&rings_lock);
+
+	/* Stash the thread in the (otherwise unused) seq so it survives the
+	 * sort */
+	for (i = 0; i < records->len; i++) {
+		g_array_index(records, struct trace_record, i).seq = g_array_index(ring_ids, guint, i);
+	}
+
+	g_array_sort(records, compare_records);
+
+	start = (records->len > max_records ? records->len - max_records : 0);
+	for (i = start; i < records->len; i++) {
+		struct trace_record* rec = &g_array_index(records, struct trace_record, i);
+		const struct trace_event_info* info = (rec->event < TRACE_EVENT_COUNT ? &event_info[rec->event] : NULL);
+
+		g_string_append_printf(ret, "%.6f t%u %s %s",
+			(rec->timestamp - trace_epoch) / (double)G_USEC_PER_SEC, (guint)rec->seq,
+			(rec->level < G_N_ELEMENTS(level_names) ? level_names[rec->level] : "?"),
+			(info ? info->name : "unknown"));
+
+		if (rec->str) g_string_append_printf(ret, " %s", rec->str);
+		if (rec->text[0]) g_string_append_printf(ret, " \"%s\"", rec->text);
+		if (info && info->arg_name) g_string_append_printf(ret, " %s=%" G_GINT64_FORMAT, info->arg_name, rec->arg);
+
+		g_string_append_c(ret, '\n');
+	}
+
+	g_array_free(ring_ids, TRUE);
+	g_array_free(records, TRUE);
+	return g_string_free(ret, FALSE);
+}
@@ -0,0 +1,68 @@
+/*
+   trace.h - Low overhead binary tracing
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <glib.h>
+
+enum trace_level {
+	TRACE_LEVEL_ERROR = 1,
+	TRACE_LEVEL_WARNING,
+	TRACE_LEVEL_INFO,
+	TRACE_LEVEL_DEBUG,
+};
+
+/* Add new events to the end, and give them a row in trace.c's table */
+enum trace_event {
+	TRACE_REQUEST,
+	TRACE_REPLY,
+	TRACE_INVALID_REQUEST,
+	TRACE_PUBLISH,
+	TRACE_PUBLISH_FAILED,
+	TRACE_BUS_MESSAGE,
+	TRACE_TAG,
+	TRACE_EVENT_COUNT,
+};
+
+/* Anything above this level compiles to nothing; build with e.g.
+ * -DTRACE_MAX_LEVEL=TRACE_LEVEL_WARNING to drop the chatty ones */
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+/* Appends a fixed-size record to the calling thread's ring. static_str
+ * must outlive the process (a literal, an interned GStreamer name), since
+ * only the pointer is kept; text is copied, truncated to a couple of dozen
+ * bytes. Either may be NULL. */
+#define TRACE(level, event, static_str, text, arg) \
+	do { \
+		if ((level) <= TRACE_MAX_LEVEL) { \
+			trace_write((level), (event), (static_str), (text), (arg)); \
+		} \
+	} while (0)
+
+void trace_write(enum trace_level level, enum trace_event event, const char* static_str, const char* text, gint64 arg);
+
+/* Decodes up to the last max_records records from every thread, oldest
+ * first, one per line */
+char* trace_decode(guint max_records);
+
+#endif
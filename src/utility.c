@@ -19,6 +19,7 @@
 */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <glib.h>
 #include <string.h>
 #include <sys/uio.h>
@@ -32,6 +33,27 @@ void util_zmq_glib_free(void* to_free, void* hint)
 	g_free(to_free);
 }
 
+void util_byte_array_free(gpointer array)
+{
+	g_byte_array_free((GByteArray*)array, TRUE);
+}
+
+gboolean util_zmq_has_more(void* sock)
+{
+#if ZMQ_VERSION_MAJOR == 2
+	int64_t more = 0;
+#else
+	int more = 0;
+#endif
+	size_t len = sizeof(more);
+
+	if (zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &len) == -1) {
+		return FALSE;
+	}
+
+	return more ? TRUE : FALSE;
+}
+
 gboolean util_close_socket(void* sock)
 {
 	if (!sock) return TRUE;
@@ -44,23 +66,40 @@ gboolean util_close_socket(void* sock)
 	return TRUE;
 }
 
-char* util_send_reqrep_msg(void* zmq_context, const char* message, const char* address)
+char* util_zmq_address_from_port(const char* address, int port)
+{
+	return g_strdup_printf("tcp://%s:%d", address, port + 10000);
+}
+
+void* util_connect_req_socket(void* zmq_context, const char* address)
 {
-	char* ret = NULL;
 	int linger = 15*1000;
-	void* sock = zmq_socket(zmq_context, ZMQ_REQ);
+	void* ret = zmq_socket(zmq_context, ZMQ_REQ);
 
-	if (!sock) {
+	if (!ret) {
 		g_warning("Failed to create socket: %s", zmq_strerror(zmq_errno()));
-		return ret;
+		return NULL;
 	}
 
-	zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(int));
+	zmq_setsockopt(ret, ZMQ_LINGER, &linger, sizeof(int));
 
-	g_print("Connecting to %s\n", address);
-	if (zmq_connect(sock, address) == -1) {
+	if (zmq_connect(ret, address) == -1) {
 		g_warning("Failed to connect: %s", zmq_strerror(zmq_errno()));
-		goto out;
+		util_close_socket(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+char* util_send_reqrep_msg(void* zmq_context, const char* message, const char* address)
+{
+	char* ret = NULL;
+	void* sock;
+
+	g_print("Connecting to %s\n", address);
+	if (!(sock = util_connect_req_socket(zmq_context, address))) {
+		return NULL;
 	}
 
 	zmq_msg_t msg;
@@ -78,7 +117,6 @@ char* util_send_reqrep_msg(void* zmq_context, const char* message, const char* a
 
 	ret = rep_text;
 
-out:
 	util_close_socket(sock);
 	return ret;
 }
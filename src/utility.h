@@ -24,6 +24,9 @@
 #ifndef ZMQ_DONTWAIT
 #   define ZMQ_DONTWAIT     ZMQ_NOBLOCK
 #endif
+#ifndef ZMQ_ROUTER
+#   define ZMQ_ROUTER       ZMQ_XREP
+#endif
 #if ZMQ_VERSION_MAJOR == 2
 #   define zmq_ctx_new() zmq_init(1)
 #   define zmq_ctx_destroy(ctx) zmq_term(ctx)
@@ -35,8 +38,12 @@
 #endif
 
 gboolean util_close_socket(void* sock);
+char* util_zmq_address_from_port(const char* address, int port);
+void* util_connect_req_socket(void* zmq_context, const char* address);
 char* util_send_reqrep_msg(void* zmq_context, const char* message, const char* address);
 void util_zmq_glib_free(void* to_free, void* hint);
+gboolean util_zmq_has_more(void* sock);
+void util_byte_array_free(gpointer array);
 char* util_hash_table_as_string(GHashTable* table);
 
 #endif
@@ -16,6 +16,14 @@
 
 #include "uuencode.h"
 
+/* The vector kernels are built for x86 whatever -m flags we're given, via
+ * target attributes, and picked at runtime from what the CPU supports */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define UUENCODE_SIMD 1
+#include <immintrin.h>
+#endif
+
 /* Conversion table.  for base 64 */
 const char uuenc_tbl_base64[65 + 1]  = {
 	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
@@ -53,7 +61,7 @@ int uuencode_get_length(int source_size)
  * buffer of at least 1+BASE64_LENGTH(length) bytes.
  * where BASE64_LENGTH(len) = (4 * ((LENGTH + 2) / 3))
  */
-void uuencode(char *p, const void *src, int length, const char *tbl)
+static void uuencode_scalar(char *p, const void *src, int length, const char *tbl)
 {
 	const unsigned char *s = src;
 
@@ -91,7 +99,7 @@ void uuencode(char *p, const void *src, int length, const char *tbl)
  * If points to '\0', then the source was fully decoded.
  * (*pp_dst): advanced past the last written byte.
  */
-const char* decode_base64(char **pp_dst, const char *src)
+static const char* decode_base64_scalar(char **pp_dst, const char *src)
 {
 	char *dst = *pp_dst;
 	const char *src_tail;
@@ -166,6 +174,254 @@ const char* decode_base64(char **pp_dst, const char *src)
 	return src_tail;
 }
 
+#ifdef UUENCODE_SIMD
+
+enum {
+	SIMD_NONE = UUENCODE_SIMD_NONE,
+	SIMD_SSSE3 = UUENCODE_SIMD_SSSE3,
+	SIMD_AVX2 = UUENCODE_SIMD_AVX2,
+};
+
+static int simd_max = SIMD_AVX2;
+
+static int simd_level(void)
+{
+	/* Racing threads all come up with the same answer */
+	static volatile int level = -1;
+
+	if (level < 0) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			level = SIMD_AVX2;
+		} else if (__builtin_cpu_supports("ssse3")) {
+			level = SIMD_SSSE3;
+		} else {
+			level = SIMD_NONE;
+		}
+	}
+
+	return MIN(level, simd_max);
+}
+
+/*
+ * The kernels below are the ones described by Wojciech Muła and Daniel
+ * Lemire: shuffle the 3 source bytes of each output quartet into a 32-bit
+ * lane, pull the four 6-bit fields apart with multiplies, and map 6-bit
+ * values to ASCII by adding an offset looked up by range. Decoding runs
+ * the same steps backwards, classifying each character by its nibbles so
+ * that a whole block can be rejected at once.
+ */
+
+#define ENC_SHUFFLE 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+#define ENC_OFFSETS 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+#define DEC_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define DEC_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define DEC_LUT_ROLL 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define DEC_PACK 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_ssse3(__m128i in)
+{
+	__m128i t0, t1, t2, t3, idx, off;
+
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(ENC_SHUFFLE));
+
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t1, t3);
+
+	/* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+	off = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	off = _mm_or_si128(off, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+
+	return _mm_add_epi8(idx, _mm_shuffle_epi8(_mm_setr_epi8(ENC_OFFSETS), off));
+}
+
+/* 12 bytes in (16 read), 16 characters out */
+__attribute__((target("ssse3")))
+static int uuencode_ssse3(char *p, const unsigned char *s, int length)
+{
+	int done = 0;
+
+	for (; length - done >= 16; done += 12, p += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i*)(s + done));
+		_mm_storeu_si128((__m128i*)p, enc_ssse3(in));
+	}
+
+	return done;
+}
+
+/* 24 bytes in (28 read), 32 characters out */
+__attribute__((target("avx2")))
+static int uuencode_avx2(char *p, const unsigned char *s, int length)
+{
+	int done = 0;
+
+	for (; length - done >= 28; done += 24, p += 32) {
+		__m256i in, t0, t1, t2, t3, idx, off;
+
+		in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(s + done))),
+			_mm_loadu_si128((const __m128i*)(s + done + 12)), 1);
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(ENC_SHUFFLE, ENC_SHUFFLE));
+
+		t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t1, t3);
+
+		off = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		off = _mm256_or_si256(off, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+
+		_mm256_storeu_si256((__m256i*)p, _mm256_add_epi8(idx, _mm256_shuffle_epi8(_mm256_setr_epi8(ENC_OFFSETS, ENC_OFFSETS), off)));
+	}
+
+	return done;
+}
+
+/* Decodes whole blocks of 16 valid characters until it runs out of input
+ * or hits anything else (padding, whitespace, garbage), leaving that to
+ * the scalar code. Returns the number of characters consumed. */
+__attribute__((target("ssse3")))
+static size_t decode_base64_ssse3(char *dst, const char *src, size_t length)
+{
+	size_t done = 0;
+
+	for (; length - done >= 16; done += 16, dst += 12) {
+		__m128i in, hi, lo, roll, out;
+
+		in = _mm_loadu_si128((const __m128i*)(src + done));
+		hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+		lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(_mm_setr_epi8(DEC_LUT_LO), lo),
+			_mm_shuffle_epi8(_mm_setr_epi8(DEC_LUT_HI), hi)), _mm_setzero_si128())) != 0xffff) {
+			break;
+		}
+
+		roll = _mm_shuffle_epi8(_mm_setr_epi8(DEC_LUT_ROLL), _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi));
+		in = _mm_add_epi8(in, roll);
+
+		out = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		out = _mm_madd_epi16(out, _mm_set1_epi32(0x00011000));
+		out = _mm_shuffle_epi8(out, _mm_setr_epi8(DEC_PACK));
+
+		/* Only 12 of the 16 bytes are ours to write */
+		guint32 tail = (guint32)_mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+		_mm_storel_epi64((__m128i*)dst, out);
+		memcpy(dst + 8, &tail, sizeof(tail));
+	}
+
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_base64_avx2(char *dst, const char *src, size_t length)
+{
+	size_t done = 0;
+
+	for (; length - done >= 32; done += 32, dst += 24) {
+		__m256i in, hi, lo, roll, out;
+
+		in = _mm256_loadu_si256((const __m256i*)(src + done));
+		hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+		lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(_mm256_setr_epi8(DEC_LUT_LO, DEC_LUT_LO), lo),
+			_mm256_shuffle_epi8(_mm256_setr_epi8(DEC_LUT_HI, DEC_LUT_HI), hi))) {
+			break;
+		}
+
+		roll = _mm256_shuffle_epi8(_mm256_setr_epi8(DEC_LUT_ROLL, DEC_LUT_ROLL),
+			_mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')), hi));
+		in = _mm256_add_epi8(in, roll);
+
+		out = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+		out = _mm256_shuffle_epi8(out, _mm256_setr_epi8(DEC_PACK, DEC_PACK));
+
+		/* Each lane has 12 bytes at the bottom; close the gap between them */
+		out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(out));
+		_mm_storel_epi64((__m128i*)(dst + 16), _mm256_extracti128_si256(out, 1));
+	}
+
+	return done;
+}
+
+#endif
+
+void uuencode_set_simd(int max_level)
+{
+#ifdef UUENCODE_SIMD
+	simd_max = max_level;
+#endif
+}
+
+int uuencode_get_simd(void)
+{
+#ifdef UUENCODE_SIMD
+	return simd_level();
+#else
+	return UUENCODE_SIMD_NONE;
+#endif
+}
+
+void uuencode(char *p, const void *src, int length, const char *tbl)
+{
+#ifdef UUENCODE_SIMD
+	/* The kernels only know the base64 alphabet */
+	if (tbl == uuenc_tbl_base64) {
+		int done = 0;
+
+		switch (simd_level()) {
+		case SIMD_AVX2:
+			done = uuencode_avx2(p, src, length);
+			/* fall through for what's left */
+		case SIMD_SSSE3:
+			done += uuencode_ssse3(p + done / 3 * 4, (const unsigned char*)src + done, length - done);
+			break;
+		}
+
+		p += done / 3 * 4;
+		src = (const unsigned char*)src + done;
+		length -= done;
+	}
+#endif
+
+	uuencode_scalar(p, src, length, tbl);
+}
+
+const char* decode_base64(char **pp_dst, const char *src)
+{
+#ifdef UUENCODE_SIMD
+	int level = simd_level();
+
+	if (level != SIMD_NONE) {
+		size_t length = strlen(src);
+		size_t done;
+
+		/* Whole blocks of 16 characters are always whole quartets, so the
+		 * scalar code picks up exactly where we leave off */
+		if (level == SIMD_AVX2) {
+			done = decode_base64_avx2(*pp_dst, src, length);
+			*pp_dst += done / 4 * 3;
+			src += done;
+			length -= done;
+		}
+
+		done = decode_base64_ssse3(*pp_dst, src, length);
+		*pp_dst += done / 4 * 3;
+		src += done;
+	}
+#endif
+
+	return decode_base64_scalar(pp_dst, src);
+}
+
 /*
  * Decode base64 encoded stream.
  * Can stop on EOF, specified char, or on uuencode-style "====" line:
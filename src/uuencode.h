@@ -16,12 +16,26 @@ enum {
 	BASE64_FLAG_NO_STOP_CHAR = 0x80,
 };
 
-const char uuenc_tbl_base64[65 + 1];
-const char uuenc_tbl_std[65];
+extern const char uuenc_tbl_base64[65 + 1];
+extern const char uuenc_tbl_std[65];
 
 void uuencode(char *p, const void *src, int length, const char *tbl);
 int uuencode_get_length(int source_size);
 const char* decode_base64(char **pp_dst, const char *src);
 int read_base64(FILE *src_stream, FILE *dst_stream, int flags);
 
+/* Caps the vector kernels that uuencode and decode_base64 pick from, so
+ * they can be checked and timed against the plain C code; by default they
+ * use the best one the CPU has */
+enum {
+	UUENCODE_SIMD_NONE,
+	UUENCODE_SIMD_SSSE3,
+	UUENCODE_SIMD_AVX2,
+};
+
+void uuencode_set_simd(int max_level);
+
+/* The kernel that's actually in use, after the cap */
+int uuencode_get_simd(void);
+
 #endif
@@ -0,0 +1,118 @@
+/*
+   zmq-source.c - GLib main loop integration for ZeroMQ sockets
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <glib.h>
+#include <zmq.h>
+
+#include "zmq-source.h"
+
+struct zms_source {
+	GSource source;
+	GPollFD poll_fd;
+	void* sock;
+};
+
+static gboolean zms_source_readable(struct zms_source* src)
+{
+#if ZMQ_VERSION_MAJOR == 2
+	guint32 events = 0;
+#else
+	int events = 0;
+#endif
+	size_t len = sizeof(events);
+
+	/* If we can't ask, claim we're readable so that the callback gets to
+	 * see (and report) the error on recv */
+	if (zmq_getsockopt(src->sock, ZMQ_EVENTS, &events, &len) == -1) {
+		return TRUE;
+	}
+
+	return (events & ZMQ_POLLIN) ? TRUE : FALSE;
+}
+
+/* NB: ZMQ_FD is edge-triggered and only tells us that *something* happened
+ * on the socket - it can stay quiet while messages are still queued, and
+ * it can fire when nothing is readable. ZMQ_EVENTS is the source of truth,
+ * so we consult it both before polling and after waking up. */
+static gboolean zms_source_prepare(GSource* source, gint* timeout)
+{
+	*timeout = -1;
+	return zms_source_readable((struct zms_source*)source);
+}
+
+static gboolean zms_source_check(GSource* source)
+{
+	return zms_source_readable((struct zms_source*)source);
+}
+
+static gboolean zms_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+	struct zms_source* src = (struct zms_source*)source;
+
+	if (!callback) {
+		g_warning("ZeroMQ source dispatched without a callback");
+		return FALSE;
+	}
+
+	return ((zms_source_func)callback)(src->sock, user_data);
+}
+
+static GSourceFuncs zms_source_funcs = {
+	zms_source_prepare,
+	zms_source_check,
+	zms_source_dispatch,
+	NULL,
+};
+
+GSource* zms_source_new(void* zmq_sock)
+{
+	struct zms_source* ret;
+	int fd;
+	size_t len = sizeof(fd);
+
+	if (zmq_getsockopt(zmq_sock, ZMQ_FD, &fd, &len) == -1) {
+		g_warning("Failed to get socket file descriptor: %s", zmq_strerror(zmq_errno()));
+		return NULL;
+	}
+
+	ret = (struct zms_source*)g_source_new(&zms_source_funcs, sizeof(struct zms_source));
+	ret->sock = zmq_sock;
+	ret->poll_fd.fd = fd;
+	ret->poll_fd.events = G_IO_IN | G_IO_ERR;
+
+	g_source_add_poll((GSource*)ret, &ret->poll_fd);
+	return (GSource*)ret;
+}
+
+guint zms_add_watch(void* zmq_sock, zms_source_func func, gpointer user_data)
+{
+	guint ret;
+	GSource* source = zms_source_new(zmq_sock);
+
+	if (!source) {
+		return 0;
+	}
+
+	g_source_set_callback(source, (GSourceFunc)func, user_data, NULL);
+	ret = g_source_attach(source, NULL);
+	g_source_unref(source);
+
+	return ret;
+}
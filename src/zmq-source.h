@@ -0,0 +1,33 @@
+/*
+   zmq-source.h - GLib main loop integration for ZeroMQ sockets
+
+   Copyright (C) 2012 Paul Betts
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _ZMQ_SOURCE_H
+#define _ZMQ_SOURCE_H
+
+#include <glib.h>
+
+/* Called whenever the socket has at least one message waiting; return FALSE
+ * to remove the source */
+typedef gboolean (*zms_source_func)(void* zmq_sock, gpointer user_data);
+
+GSource* zms_source_new(void* zmq_sock);
+guint zms_add_watch(void* zmq_sock, zms_source_func func, gpointer user_data);
+
+#endif